@@ -0,0 +1,234 @@
+/** Benchmarks of the shellfyre hot paths
+  Build and run with make bench. Every result is printed on its own line as
+  <benchmark>.<metric> <value> <unit>
+  so two runs can be compared line by line. Usage: bench [path to shellfyre]
+ **/
+
+#define SHELLFYRE_NO_MAIN
+#include "../shellfyre.c"
+
+#include <pty.h>
+
+#define parseIterations 200000
+#define spawnIterations 500
+#define searchTreeFiles 5000
+#define searchTreeFanout 10
+#define historyEntries 10000
+#define historyIterations 1000
+#define echoKeys 200
+
+unsigned long long benchNow(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void report(const char *benchmark, const char *metric, double value, const char *unit){
+	printf("%s.%s %.3f %s\n", benchmark, metric, value, unit);
+	fflush(stdout);
+}
+
+int compareDoubles(const void *first, const void *second){
+	double a = *(const double *)first, b = *(const double *)second;
+	return (a > b) - (a < b);
+}
+
+void reportPercentiles(const char *benchmark, double *samples, int count, const char *unit){
+	qsort(samples, count, sizeof(double), compareDoubles);
+	report(benchmark, "p50", samples[count / 2], unit);
+	report(benchmark, "p99", samples[(count * 99) / 100], unit);
+	report(benchmark, "max", samples[count - 1], unit);
+}
+
+// silences stdout of the shell functions under test, returns the saved descriptor
+int silenceStdout(){
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, STDOUT_FILENO);
+	close(devNull);
+	return saved;
+}
+
+void restoreStdout(int saved){
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+struct command_t *parseLine(const char *line){
+	char buf[maxCommandSize];
+	struct command_t *command = calloc(1, sizeof(struct command_t));
+	snprintf(buf, sizeof(buf), "%s", line);
+	parse_command(buf, command);
+	return command;
+}
+
+void benchParse(){
+	static const char *lines[] = {
+		"ls -la /tmp",
+		"filesearch -r -o needle",
+		"cat input.txt | grep -v foo | sort | uniq -c > counts.txt",
+		"gcc -O2 -Wall -Wextra -g -c a.c b.c c.c d.c e.c f.c g.c h.c -o out -lm -ldl -lutil &",
+	};
+	int lineCount = sizeof(lines) / sizeof(lines[0]);
+
+	unsigned long long start = benchNow();
+	for(int i = 0; i < parseIterations; i++) free_command(parseLine(lines[i % lineCount]));
+	double elapsed = benchNow() - start;
+
+	report("parse_command", "ns_per_op", elapsed / parseIterations, "ns");
+	report("parse_command", "ops_per_s", parseIterations / (elapsed / 1e9), "ops/s");
+}
+
+void benchSpawn(){
+	double samples[spawnIterations];
+	for(int i = 0; i < spawnIterations; i++){
+		struct command_t *command = parseLine("/bin/true");
+		unsigned long long start = benchNow();
+		process_command(command);
+		samples[i] = (benchNow() - start) / 1000.0;
+		free_command(command);
+	}
+	reportPercentiles("spawn_true", samples, spawnIterations, "us");
+}
+
+// creates count files spread over a tree with fanout directories per level
+void makeSearchTree(const char *root, int count){
+	char path[PATH_MAX];
+	mkdir(root, 0755);
+	for(int i = 0; i < count; i++){
+		int level1 = i % searchTreeFanout, level2 = (i / searchTreeFanout) % searchTreeFanout;
+		snprintf(path, sizeof(path), "%s/d%d", root, level1);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/d%d/e%d", root, level1, level2);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/d%d/e%d/file%d%s", root, level1, level2, i, i % 100 == 0 ? "needle" : "");
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
+}
+
+void removeTree(const char *path){
+	char *parameters[] = {"/bin/rm", "-rf", (char *)path, NULL};
+	runAndWait(parameters);
+}
+
+void benchFilesearch(const char *workDir){
+	char root[PATH_MAX], cwd[PATH_MAX];
+	snprintf(root, sizeof(root), "%s/tree", workDir);
+	makeSearchTree(root, searchTreeFiles);
+	getcwd(cwd, sizeof(cwd));
+	chdir(root);
+
+	struct command_t *command = parseLine("filesearch -r needle");
+	int saved = silenceStdout();
+	unsigned long long start = benchNow();
+	executeFilesearch(command, "./", "needle");
+	double elapsed = benchNow() - start;
+	restoreStdout(saved);
+	free_command(command);
+	chdir(cwd);
+
+	report("filesearch_recursive", "ms", elapsed / 1e6, "ms");
+	report("filesearch_recursive", "files_per_s", searchTreeFiles / (elapsed / 1e9), "files/s");
+	removeTree(root);
+}
+
+void benchHistory(const char *workDir){
+	static char visitHistory[maxRecentShown][maxDirectoryPath];
+	char cwd[PATH_MAX];
+
+	//history file with historyEntries lines, where cd and take would keep it
+	getcwd(cwd, sizeof(cwd));
+	chdir(workDir);
+	initializeFilePath();
+	chdir(cwd);
+	FILE *fp = fopen(currentFilePath, "w");
+	for(int i = 0; i < historyEntries; i++) fprintf(fp, "/home/user/projects/shellfyre/dir%d\n", i);
+	fclose(fp);
+
+	unsigned long long start = benchNow();
+	for(int i = 0; i < historyIterations; i++) updateRecentDirectories();
+	report("history_update", "ns_per_op", (double)(benchNow() - start) / historyIterations, "ns");
+
+	start = benchNow();
+	for(int i = 0; i < historyIterations; i++){
+		fp = fopen(currentFilePath, "r");
+		loadRecentDirectories(fp, visitHistory);
+		fclose(fp);
+	}
+	report("history_load", "ns_per_op", (double)(benchNow() - start) / historyIterations, "ns");
+	unlink(currentFilePath);
+}
+
+// reads from the pty until text shows up, returns -1 on timeout
+int waitForOutput(int fd, const char *text, int timeoutMs){
+	char buffer[4096];
+	size_t used = 0;
+	struct pollfd pfd = {fd, POLLIN, 0};
+	while(poll(&pfd, 1, timeoutMs) > 0){
+		ssize_t len = read(fd, buffer + used, sizeof(buffer) - 1 - used);
+		if(len <= 0) return -1;
+		used += len;
+		buffer[used] = 0;
+		if(strstr(buffer, text) != NULL) return 0;
+		if(used > sizeof(buffer) / 2){
+			memmove(buffer, buffer + used - strlen(text), strlen(text));
+			used = strlen(text);
+		}
+	}
+	return -1;
+}
+
+void benchKeystrokeEcho(const char *shellPath){
+	int master;
+	pid_t pid = forkpty(&master, NULL, NULL, NULL);
+	if(pid == 0){
+		execl(shellPath, shellPath, (char *)NULL);
+		_exit(127);
+	}
+	if(pid < 0 || waitForOutput(master, "$ ", 5000) != 0){
+		fprintf(stderr, "keystroke_echo: %s did not show a prompt\n", shellPath);
+		if(pid > 0){
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+		return;
+	}
+
+	double samples[echoKeys];
+	int count = 0;
+	for(int i = 0; i < echoKeys; i++){
+		char key[2] = {'a' + i % 26, 0};
+		unsigned long long start = benchNow();
+		if(write(master, key, 1) != 1 || waitForOutput(master, key, 1000) != 0) break;
+		samples[count++] = (benchNow() - start) / 1000.0;
+	}
+	//erasing the typed line before leaving
+	for(int i = 0; i < count; i++) write(master, "\x7f", 1);
+	write(master, "exit\n", 5);
+	waitpid(pid, NULL, 0);
+	close(master);
+
+	if(count > 0) reportPercentiles("keystroke_echo", samples, count, "us");
+}
+
+int main(int argc, char **argv){
+	const char *shellPath = argc > 1 ? argv[1] : "./shellfyre";
+	char workDir[] = "/tmp/shellfyre-bench-XXXXXX";
+
+	if(mkdtemp(workDir) == NULL){
+		perror("mkdtemp");
+		return 1;
+	}
+	registerDefaultBuiltins();
+
+	benchParse();
+	benchSpawn();
+	benchFilesearch(workDir);
+	benchHistory(workDir);
+	benchKeystrokeEcho(shellPath);
+
+	rmdir(workDir);
+	return 0;
+}
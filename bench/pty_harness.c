@@ -0,0 +1,347 @@
+/** Pty session harness of shellfyre
+  Runs shellfyre under a pseudo-terminal, replays keystroke sessions and checks
+  what the shell prints. Build and run with make ptycheck, or
+  pty_harness <path to shellfyre> <session files...>
+
+  A session file has one step per line, # starts a comment:
+    type <text>     types the text key by key, waiting for the echo of each key
+    paste <text>    writes the text in one piece, like a pasted block
+    key <name>      sends up, down, tab, backspace, enter or ctrl-d without waiting
+    enter           sends enter and waits for the next prompt
+    line <text>     sends the text and enter at once, for programs reading a line
+    wait <text>     waits until the text is printed
+    expect <text>   the output since the last enter or wait contains the text
+    reject <text>   the output since the last enter or wait does not contain the text
+    shows <text>    waits until the line under the cursor, as the terminal draws it, contains the text
+    hides <text>    the line under the cursor does not contain the text
+    restart         starts a new shell in the same directory and waits for its first prompt,
+                    the output it printed before the prompt can be checked with expect
+
+  Keystroke-to-echo and enter-to-prompt latencies are printed in the same
+  <name>.<metric> <value> <unit> format as make bench, then pass or fail.
+ **/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define promptMarker "shellfyre$ "
+#define maxSamples 4096
+#define maxOutput 65536
+#define stepTimeoutMs 5000
+
+struct session_t
+{
+	const char *shellPath;
+	const char *workDir;
+	int master;
+	pid_t pid;
+	char output[maxOutput];		// printed since the last enter or wait
+	size_t outputLen;
+	double keySamples[maxSamples];
+	int keyCount;
+	double enterSamples[maxSamples];
+	int enterCount;
+	int failures;
+};
+
+unsigned long long harnessNow(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+   Reads more shell output, returns false when nothing arrives before the deadline.
+   The output buffer keeps its newest half when it fills up, offset is moved along.
+   */
+bool readOutput(struct session_t *session, unsigned long long deadline, size_t *offset){
+	struct pollfd pfd = {session->master, POLLIN, 0};
+	long long remaining = (long long)(deadline - harnessNow()) / 1000000;
+	if(remaining <= 0 || poll(&pfd, 1, remaining) <= 0) return false;
+
+	if(session->outputLen > maxOutput - 1024){
+		size_t keep = maxOutput / 2;
+		memmove(session->output, session->output + session->outputLen - keep, keep);
+		*offset = *offset > session->outputLen - keep ? *offset - (session->outputLen - keep) : 0;
+		session->outputLen = keep;
+	}
+	ssize_t len = read(session->master, session->output + session->outputLen, maxOutput - 1 - session->outputLen);
+	if(len <= 0) return false;
+	session->outputLen += len;
+	return true;
+}
+
+/*
+   Reads the shell output until text shows up after offset, or the timeout passes.
+   */
+bool waitFor(struct session_t *session, const char *text, size_t offset){
+	unsigned long long deadline = harnessNow() + stepTimeoutMs * 1000000ULL;
+
+	while(1){
+		session->output[session->outputLen] = 0;
+		if(offset <= session->outputLen && strstr(session->output + offset, text) != NULL) return true;
+		if(!readOutput(session, deadline, &offset)) return false;
+	}
+}
+
+/*
+   Draws the line under the cursor from the output the way the terminal would, applying
+   backspaces and carriage returns, so text that was typed and erased is not on it.
+   */
+void screenLine(struct session_t *session, char *line, size_t size){
+	size_t column = 0, len = 0;
+	session->output[session->outputLen] = 0;
+	for(const char *p = session->output; *p; p++){
+		if(*p == '\n'){
+			column = len = 0;
+		}else if(*p == '\r'){
+			column = 0;
+		}else if(*p == '\b'){
+			if(column > 0) column--;
+		}else if(*p == '\033' && p[1] == '['){
+			//control sequences move nothing the shell uses, they are skipped
+			for(p += 2; *p && (*p < 0x40 || *p > 0x7e); p++);
+			if(*p == 0) break;
+		}else if((unsigned char)*p >= ' ' && column < size - 1){
+			line[column++] = *p;
+			if(column > len) len = column;
+		}
+	}
+	line[len] = 0;
+}
+
+bool waitForLine(struct session_t *session, const char *text){
+	unsigned long long deadline = harnessNow() + stepTimeoutMs * 1000000ULL;
+	static char line[maxOutput];
+	size_t offset = 0;
+
+	while(1){
+		screenLine(session, line, sizeof(line));
+		if(strstr(line, text) != NULL) return true;
+		if(!readOutput(session, deadline, &offset)) return false;
+	}
+}
+
+void sendBytes(struct session_t *session, const char *bytes, size_t len){
+	while(len > 0){
+		ssize_t written = write(session->master, bytes, len);
+		if(written <= 0) return;
+		bytes += written;
+		len -= written;
+	}
+}
+
+void fail(struct session_t *session, const char *file, int lineNumber, const char *message, const char *text){
+	fprintf(stderr, "%s:%d: %s: %s\n", file, lineNumber, message, text);
+	fprintf(stderr, "---- output ----\n%s\n----------------\n", session->output);
+	session->failures++;
+}
+
+void addSample(double *samples, int *count, double value){
+	if(*count < maxSamples) samples[(*count)++] = value;
+}
+
+int compareSamples(const void *first, const void *second){
+	double a = *(const double *)first, b = *(const double *)second;
+	return (a > b) - (a < b);
+}
+
+void reportSamples(const char *name, const char *metric, double *samples, int count){
+	if(count == 0) return;
+	qsort(samples, count, sizeof(double), compareSamples);
+	printf("%s.%s.p50 %.3f us\n", name, metric, samples[count / 2]);
+	printf("%s.%s.p99 %.3f us\n", name, metric, samples[(count * 99) / 100]);
+}
+
+/*
+   Starts the shell under a new pseudo-terminal in the work directory, which is also its HOME,
+   and waits for the first prompt. The caches of the shell are kept under HOME as well.
+   */
+bool startShell(struct session_t *session){
+	struct winsize size = {24, 200, 0, 0};
+	session->outputLen = 0;
+	session->pid = forkpty(&session->master, NULL, NULL, &size);
+	if(session->pid == 0){
+		if(chdir(session->workDir) != 0) _exit(127);
+		setenv("HOME", session->workDir, 1);
+		unsetenv("XDG_CACHE_HOME");
+		unsetenv("SHELLFYRE_RC");
+		unsetenv("SHELLFYRE_STARTUP_CACHE");
+		execl(session->shellPath, session->shellPath, (char *)NULL);
+		_exit(127);
+	}
+	return session->pid > 0 && waitFor(session, promptMarker, 0);
+}
+
+void stopShell(struct session_t *session){
+	if(session->pid <= 0) return;
+	kill(session->pid, SIGKILL);
+	waitpid(session->pid, NULL, 0);
+	close(session->master);
+	session->pid = 0;
+}
+
+/*
+   Runs one step of a session, returns false when the session cannot go on.
+   */
+bool runStep(struct session_t *session, char *step, const char *file, int lineNumber){
+	char *argument = strchr(step, ' ');
+	if(argument != NULL) *argument++ = 0;
+	else argument = "";
+
+	if(strcmp(step, "type") == 0){
+		for(char *key = argument; *key; key++){
+			char echo[2] = {*key, 0};
+			size_t offset = session->outputLen;
+			unsigned long long start = harnessNow();
+			sendBytes(session, key, 1);
+			if(!waitFor(session, echo, offset)){
+				fail(session, file, lineNumber, "no echo for key", echo);
+				return false;
+			}
+			addSample(session->keySamples, &session->keyCount, (harnessNow() - start) / 1000.0);
+		}
+	}else if(strcmp(step, "paste") == 0){
+		size_t offset = session->outputLen;
+		sendBytes(session, argument, strlen(argument));
+		if(!waitFor(session, argument, offset)){
+			fail(session, file, lineNumber, "pasted text was not echoed", argument);
+			return false;
+		}
+	}else if(strcmp(step, "key") == 0){
+		static const char *names[] = {"up", "down", "tab", "backspace", "enter", "ctrl-d"};
+		static const char *codes[] = {"\033[A", "\033[B", "\t", "\177", "\n", "\004"};
+		size_t i;
+		for(i = 0; i < sizeof(names) / sizeof(names[0]) && strcmp(names[i], argument) != 0; i++);
+		if(i == sizeof(names) / sizeof(names[0])){
+			fail(session, file, lineNumber, "unknown key", argument);
+			return false;
+		}
+		sendBytes(session, codes[i], strlen(codes[i]));
+	}else if(strcmp(step, "enter") == 0){
+		session->outputLen = 0;
+		unsigned long long start = harnessNow();
+		sendBytes(session, "\n", 1);
+		if(!waitFor(session, promptMarker, 0)){
+			fail(session, file, lineNumber, "no prompt after enter", promptMarker);
+			return false;
+		}
+		addSample(session->enterSamples, &session->enterCount, (harnessNow() - start) / 1000.0);
+	}else if(strcmp(step, "line") == 0){
+		session->outputLen = 0;
+		sendBytes(session, argument, strlen(argument));
+		sendBytes(session, "\n", 1);
+	}else if(strcmp(step, "wait") == 0){
+		if(!waitFor(session, argument, 0)){
+			fail(session, file, lineNumber, "timed out waiting for", argument);
+			return false;
+		}
+	}else if(strcmp(step, "expect") == 0){
+		session->output[session->outputLen] = 0;
+		if(strstr(session->output, argument) == NULL) fail(session, file, lineNumber, "missing output", argument);
+	}else if(strcmp(step, "reject") == 0){
+		session->output[session->outputLen] = 0;
+		if(strstr(session->output, argument) != NULL) fail(session, file, lineNumber, "unexpected output", argument);
+	}else if(strcmp(step, "restart") == 0){
+		stopShell(session);
+		if(!startShell(session)){
+			fail(session, file, lineNumber, "shell did not show a prompt after", step);
+			return false;
+		}
+	}else if(strcmp(step, "shows") == 0){
+		if(!waitForLine(session, argument)) fail(session, file, lineNumber, "line does not show", argument);
+	}else if(strcmp(step, "hides") == 0){
+		static char line[maxOutput];
+		screenLine(session, line, sizeof(line));
+		if(strstr(line, argument) != NULL) fail(session, file, lineNumber, "line still shows", argument);
+	}else{
+		fail(session, file, lineNumber, "unknown step", step);
+		return false;
+	}
+	return true;
+}
+
+/*
+   Runs a session file against a fresh shell started in an empty directory.
+   */
+int runSession(const char *shellPath, const char *file){
+	static struct session_t session;
+	char name[PATH_MAX], workDir[] = "/tmp/shellfyre-pty-XXXXXX";
+	FILE *fp = fopen(file, "r");
+	if(fp == NULL){
+		perror(file);
+		return 1;
+	}
+	if(mkdtemp(workDir) == NULL){
+		perror("mkdtemp");
+		fclose(fp);
+		return 1;
+	}
+
+	//session name is the file name without directories and extension
+	const char *base = strrchr(file, '/') ? strrchr(file, '/') + 1 : file;
+	snprintf(name, sizeof(name), "pty.%.*s", (int)strcspn(base, "."), base);
+
+	memset(&session, 0, sizeof(session));
+	session.shellPath = shellPath;
+	session.workDir = workDir;
+	if(!startShell(&session)){
+		fprintf(stderr, "%s: shell did not show a prompt\n", file);
+		session.failures++;
+	}
+
+	char *line = NULL;
+	size_t lineSize = 0;
+	int lineNumber = 0;
+	while(session.failures == 0 && getline(&line, &lineSize, fp) > 0){
+		lineNumber++;
+		line[strcspn(line, "\r\n")] = 0;
+		if(line[0] == 0 || line[0] == '#') continue;
+		if(!runStep(&session, line, file, lineNumber)) break;
+	}
+	free(line);
+	fclose(fp);
+
+	stopShell(&session);
+	char *parameters[] = {"/bin/rm", "-rf", workDir, NULL};
+	pid_t pid = fork();
+	if(pid == 0){
+		execv(parameters[0], parameters);
+		_exit(127);
+	}
+	if(pid > 0) waitpid(pid, NULL, 0);
+
+	reportSamples(name, "keystroke_echo", session.keySamples, session.keyCount);
+	reportSamples(name, "enter_to_prompt", session.enterSamples, session.enterCount);
+	printf("%s.result %s\n", name, session.failures == 0 ? "pass" : "fail");
+	fflush(stdout);
+	return session.failures != 0;
+}
+
+int main(int argc, char **argv){
+	if(argc < 3){
+		fprintf(stderr, "usage: %s <path to shellfyre> <session files...>\n", argv[0]);
+		return 2;
+	}
+
+	char shellPath[PATH_MAX];
+	if(realpath(argv[1], shellPath) == NULL){
+		perror(argv[1]);
+		return 2;
+	}
+
+	int failed = 0;
+	for(int i = 2; i < argc; i++) failed += runSession(shellPath, argv[i]);
+	return failed != 0;
+}
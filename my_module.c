@@ -9,11 +9,35 @@
 #include<linux/slab.h>
 #include<linux/uaccess.h>
 #include<linux/sched.h>
+#include<linux/mm.h>
+#include<linux/vmalloc.h>
+#include<linux/mutex.h>
+#include<linux/rcupdate.h>
+#include<linux/sched/signal.h>
+#include<linux/sched/task.h>
+#include<linux/version.h>
 #include "my_module_variables.h"
 
 #define mem_size 1024
 #define maxQueue 200
-uint8_t *kernel_buffer;
+
+// every open of the device gets its own state, so concurrent readers never share buffers
+struct my_file_state
+{
+	struct mutex lock;
+	uint8_t *kernel_buffer;
+	size_t buffer_len;
+	struct ps_ring *ring;
+	struct ps_ring_consumer *consumer;
+	// producer indices live here, the copies in the mapped ring are never read back
+	unsigned int ringHead;
+	unsigned int ringCapacity;
+	unsigned int ringDropped;
+	// queue for bfs search, stack for dfs search
+	struct task_struct *pending[maxQueue];
+	int front;
+	int rear;
+};
 
 dev_t dev = 0;
 
@@ -27,10 +51,14 @@ static int my_release(struct inode *inode, struct file *file);
 static ssize_t my_read(struct file *filp, char __user *buf, size_t len, loff_t *off);
 static ssize_t my_write(struct file *filp, const char *buf, size_t len, loff_t *off);
 static long my_ioctl(struct file *filp, unsigned int mode, unsigned long arg);
-// queue for bfs search
-struct task_struct *bfsQueue[maxQueue];
-int front = 0;
-int rear = 0;
+static int my_mmap(struct file *filp, struct vm_area_struct *vma);
+//the device argument of devnode became const in 6.2
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define MY_DEVNODE_DEVICE const struct device
+#else
+#define MY_DEVNODE_DEVICE struct device
+#endif
+static char *my_devnode(MY_DEVNODE_DEVICE *dev, umode_t *mode);
 
 static struct file_operations fops = 
 {
@@ -40,66 +68,200 @@ static struct file_operations fops =
 	.open	= my_open,
 	.release = my_release, 
 	.unlocked_ioctl = my_ioctl,
+	.mmap	= my_mmap,
 };
 
-void breadthFirstSearch(struct task_struct *task)
-{   
-	struct task_struct *child, *grandChild, *currentTask = task;
-	struct list_head *list, *grandChildList;
-	int i, j, frontDummy = -1;
+//counts a record that could not be queued and publishes the count to the reader
+static void dropRecord(struct my_file_state *state)
+{
+	state->ringDropped++;
+	WRITE_ONCE(state->ring->dropped, state->ringDropped);
+}
+
+/*
+   Appends a task to the shared ring of the file. The reader advances tail,
+   so when the ring is full the record is dropped and counted instead of
+   overwriting entries that may still be read. Head and capacity are taken
+   from the file state only; tail is written by user space, so it is read
+   once and anything claiming more than a full ring counts as full.
+   */
+static void pushRecord(struct my_file_state *state, struct task_struct *task)
+{
+	struct ps_record *record;
+	unsigned int head = state->ringHead;
+	unsigned int used = head - READ_ONCE(state->consumer->tail);
+
 	printk(KERN_INFO"PID: %d, Procces name: %s\n", task->pid, task->comm);
-	while(frontDummy != rear){
-		//after initial call, don't add children
-		if(frontDummy == -1){
+
+	if(used >= state->ringCapacity){
+		dropRecord(state);
+		return;
+	}
+	record = &state->ring->records[head % state->ringCapacity];
+	record->pid = task->pid;
+	record->ppid = task->real_parent->pid;
+	strscpy(record->comm, task->comm, psCommLen);
+	state->ringHead = head + 1;
+	//publishing the record only after it is filled
+	smp_store_release(&state->ring->head, state->ringHead);
+}
+
+/*
+   Adds one process to the subtree totals. Threads are summed through the
+   thread group, the time of threads that already exited is kept in signal.
+   */
+static void addTotals(struct ps_totals *totals, struct task_struct *task)
+{
+	struct task_struct *thread;
+	struct mm_struct *mm;
+	unsigned int stateIndex = task_state_index(task);
+
+	totals->tasks++;
+	totals->threads += get_nr_threads(task);
+	if(stateIndex < psStateCount) totals->states[stateIndex]++;
+
+	//mm cannot go away while task_lock is held
+	task_lock(task);
+	mm = task->mm;
+	if(mm) totals->rssPages += get_mm_rss(mm);
+	task_unlock(task);
+
+	totals->utimeNs += task->signal->utime;
+	totals->stimeNs += task->signal->stime;
+	for_each_thread(task, thread) {
+		totals->utimeNs += thread->utime;
+		totals->stimeNs += thread->stime;
+	}
+}
+
+//in aggregation mode the nodes are only counted, not queued to the ring
+static void visitTask(struct my_file_state *state, struct task_struct *task, struct ps_totals *totals)
+{
+	if(totals) addTotals(totals, task);
+	else pushRecord(state, task);
+}
+
+//a child that does not fit in the queue is reported where the caller will see it
+static void dropChild(struct my_file_state *state, struct ps_totals *totals)
+{
+	if(totals) totals->dropped++;
+	else dropRecord(state);
+}
+
+void breadthFirstSearch(struct my_file_state *state, struct task_struct *task, struct ps_totals *totals)
+{
+	struct task_struct *child, *currentTask;
+	struct list_head *list;
+	int queued = 0;
+
+	state->front = 0;
+	state->rear = 0;
+	state->pending[state->rear++] = task;
+	queued++;
+
+	while(queued > 0){
+		//dequeue a task, print its pid and name
+		currentTask = state->pending[state->front];
+		state->front = (state->front + 1) % maxQueue;
+		queued--;
+		visitTask(state, currentTask, totals);
+
 		list_for_each(list, &currentTask->children) {
-			//if rear pointer reaches maximum, sets it to beginning of array
-			if(rear + 1 == maxQueue) rear = 0;
+			//queue is full, the remaining children cannot be visited
+			if(queued == maxQueue){
+				dropChild(state, totals);
+				continue;
+			}
 			child = list_entry(list, struct task_struct, sibling);
-			//queue children
-			bfsQueue[rear] = child;
-			rear++;
-		}
+			state->pending[state->rear] = child;
+			state->rear = (state->rear + 1) % maxQueue;
+			queued++;
 		}
-		j = rear;
-		for(i = front; i<j; i++){
-			//if front pointer reaches maximum, sets it to beginning of array
-			if(front + 1 == maxQueue) front = 0;
-			//dequeue children, print its pid and name
-			printk(KERN_INFO"PID: %d, Procces name: %s\n", bfsQueue[front]->pid, bfsQueue[front]->comm);
-
-			list_for_each(grandChildList, &bfsQueue[front]->children) {
-				if(rear + 1 == maxQueue) rear = 0;
-				grandChild = list_entry(grandChildList, struct task_struct, sibling);
-				//queue grandchildren
-				bfsQueue[rear] = grandChild;
-				rear++;
+	}
+}
+
+/*
+   Walks the subtree in preorder with an explicit stack instead of recursion,
+   the kernel stack is too small for deep process trees. Children are pushed
+   last to first so they are still visited in list order.
+   */
+void depthFirstSearch(struct my_file_state *state, struct task_struct *task, struct ps_totals *totals)
+{
+	struct task_struct *child, *currentTask;
+	struct list_head *list;
+	int top = 0;
+
+	state->pending[top++] = task;
+
+	while(top > 0){
+		currentTask = state->pending[--top];
+		visitTask(state, currentTask, totals);
+
+		list_for_each_prev(list, &currentTask->children) {
+			if(top == maxQueue){
+				dropChild(state, totals);
+				continue;
 			}
-			front++;
+			child = list_entry(list, struct task_struct, sibling);
+			state->pending[top++] = child;
 		}
-		currentTask = bfsQueue[front];
-		frontDummy = front;
 	}
 }
 
+/*
+   Finds the given pid and walks its subtree under rcu, totals is NULL unless
+   the caller asked for aggregation.
+   */
+static int traverseSubtree(struct my_file_state *state, pid_t rootPid, bool depthFirst, struct ps_totals *totals)
+{
+	struct task_struct *givenProcces;
 
-void depthFirstSearch(struct task_struct *task)
-{   
-	struct task_struct *child;
-	struct list_head *list;
-
-	printk(KERN_INFO"PID: %d, Procces name: %s\n", task->pid, task->comm);
+	mutex_lock(&state->lock);
+	rcu_read_lock();
+	//getting task_struct of given procces
+	givenProcces = pid_task(find_vpid(rootPid), PIDTYPE_PID);
 
-	list_for_each(list, &task->children) {
-		child = list_entry(list, struct task_struct, sibling);
-		depthFirstSearch(child);
+	if(givenProcces == NULL){
+		rcu_read_unlock();
+		mutex_unlock(&state->lock);
+		printk(KERN_INFO"Pid is invalid");
+		return -ESRCH;
+	}
+	if(depthFirst){
+	depthFirstSearch(state, givenProcces, totals);
+	}else{
+	breadthFirstSearch(state, givenProcces, totals);
+	}
+	rcu_read_unlock();
+
+	//keeping a text copy of the totals so they can also be read from the device
+	if(totals){
+		static const char stateNames[psStateCount] = {'R', 'S', 'D', 'T', 't', 'X', 'Z', 'P', 'I'};
+		size_t len;
+		int i;
+
+		len = scnprintf(state->kernel_buffer, mem_size,
+				"pid %d tasks %u threads %u rss_pages %llu utime_ns %llu stime_ns %llu dropped %u",
+				totals->pid, totals->tasks, totals->threads, totals->rssPages,
+				totals->utimeNs, totals->stimeNs, totals->dropped);
+		for(i = 0; i < psStateCount; i++)
+			len += scnprintf(state->kernel_buffer + len, mem_size - len, " %c %u", stateNames[i], totals->states[i]);
+		len += scnprintf(state->kernel_buffer + len, mem_size - len, "\n");
+		state->buffer_len = len;
 	}
+	mutex_unlock(&state->lock);
+	return 0;
 }
 
 static long my_ioctl(struct file *filp, unsigned int mode, unsigned long arg){
+	struct my_file_state *state = filp->private_data;
 	long longRootPid;
-	char ** commandArgs;
+	char __user **commandArgs;
+	char __user *userArgs[2];
+	char pidString[16], flag[4];
 	pid_t rootPid;
-	struct task_struct *givenProcces;
+	struct ps_totals totals;
+	int check, depthFirst;
 
 	switch (mode)
 	{
@@ -108,36 +270,51 @@ static long my_ioctl(struct file *filp, unsigned int mode, unsigned long arg){
 			break;
 			//this case should get the PID number from user space and traverse 
 		case WRITE_VAL:
-			if (copy_from_user(&commandArgs, (long unsigned *)arg, sizeof(char**)))
+			//argument array and the strings it points to are both in user memory
+			if (copy_from_user(&commandArgs, (char __user ***)arg, sizeof(commandArgs)) ||
+					copy_from_user(userArgs, commandArgs, sizeof(userArgs)))
 			{
-				return -EACCES;
+				return -EFAULT;
 			}
-			printk(KERN_INFO"Initial pid: %s\n", *commandArgs);
-			printk(KERN_INFO"Flag: %s\n", commandArgs[1]);
+			if (strncpy_from_user(pidString, userArgs[0], sizeof(pidString)) < 0)
+				return -EFAULT;
+			pidString[sizeof(pidString) - 1] = 0;
+			flag[0] = 0;
+			if (userArgs[1] != NULL && strncpy_from_user(flag, userArgs[1], sizeof(flag)) < 0)
+				return -EFAULT;
+			flag[sizeof(flag) - 1] = 0;
+
+			printk(KERN_INFO"Initial pid: %s\n", pidString);
+			printk(KERN_INFO"Flag: %s\n", flag);
 
 			//converting from strgin to long
-			if(kstrtol(commandArgs[0], 10, &longRootPid) != 0){
+			if(kstrtol(pidString, 10, &longRootPid) != 0){
 				printk(KERN_INFO"Error in conversion of string pid to long value");
-				return -EFAULT;
+				return -EINVAL;
+			}
+			if(strcmp(flag, "-d") != 0 && strcmp(flag, "-b") != 0){
+				printk(KERN_INFO"Invalid flag");
+				return -EINVAL;
 			}
 
 			rootPid = (pid_t) longRootPid;
-			//getting task_struct of given procces
-			givenProcces = pid_task(find_vpid(rootPid), PIDTYPE_PID);
+			return traverseSubtree(state, rootPid, strcmp(flag, "-d") == 0, NULL);
 
-			if(givenProcces == NULL){
-				printk(KERN_INFO"Pid is invalid");
+			//sums task, thread, memory and cpu time counts of the subtree in one pass
+		case AGGREGATE_VAL:
+			if (copy_from_user(&totals, (struct ps_totals __user *)arg, sizeof(totals)))
+				return -EFAULT;
+			rootPid = totals.pid;
+			depthFirst = totals.depthFirst != 0;
+			memset(&totals, 0, sizeof(totals));
+			totals.pid = rootPid;
+			totals.depthFirst = depthFirst;
+
+			check = traverseSubtree(state, rootPid, depthFirst, &totals);
+			if (check != 0)
+				return check;
+			if (copy_to_user((struct ps_totals __user *)arg, &totals, sizeof(totals)))
 				return -EFAULT;
-			}
-			if(strcmp(commandArgs[1], "-d") == 0){
-			depthFirstSearch(givenProcces);
-			}else if(strcmp(commandArgs[1], "-b") == 0){
-			breadthFirstSearch(givenProcces);
-			}else{
-			printk(KERN_INFO"Invalid flag");
-			}
-
-
 			break;
 		default:
 			return -EINVAL;
@@ -147,33 +324,102 @@ static long my_ioctl(struct file *filp, unsigned int mode, unsigned long arg){
 }
 static int my_open(struct inode *inode, struct file * file)
 {	
-	if((kernel_buffer = kmalloc(mem_size, GFP_KERNEL)) == 0) {
+	struct my_file_state *state;
+
+	if((state = kzalloc(sizeof(*state), GFP_KERNEL)) == NULL) {
 		printk(KERN_INFO "Cannot allocate the memory to the kernel...\n");
-		return -1;
+		return -ENOMEM;
 	}
+	state->kernel_buffer = kmalloc(mem_size, GFP_KERNEL);
+	//ring memory is mapped to user space, so it has to come from vmalloc_user
+	state->ring = vmalloc_user(ringSize);
+	state->consumer = vmalloc_user(PAGE_SIZE);
+	if(state->kernel_buffer == NULL || state->ring == NULL || state->consumer == NULL) {
+		printk(KERN_INFO "Cannot allocate the memory to the kernel...\n");
+		kfree(state->kernel_buffer);
+		vfree(state->ring);
+		vfree(state->consumer);
+		kfree(state);
+		return -ENOMEM;
+	}
+	state->ringCapacity = (ringSize - sizeof(struct ps_ring)) / sizeof(struct ps_record);
+	state->ring->capacity = state->ringCapacity;
+	mutex_init(&state->lock);
+	file->private_data = state;
 	printk(KERN_INFO "Device file opened...\n");
 	return 0;
 }
 
 static int my_release(struct inode *inode, struct file *file)
 {
-	kfree(kernel_buffer);
+	struct my_file_state *state = file->private_data;
+
+	kfree(state->kernel_buffer);
+	vfree(state->ring);
+	vfree(state->consumer);
+	kfree(state);
 	printk(KERN_INFO "Device FILE closed...\n");
 	return 0;
 }
 
 static ssize_t my_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
 {	
-	if(copy_to_user(buf, kernel_buffer, mem_size) != 0) return -EFAULT;
-	printk(KERN_INFO "Data read : BONE...\n");
-	return mem_size;
+	struct my_file_state *state = filp->private_data;
+	ssize_t count;
+
+	mutex_lock(&state->lock);
+	count = simple_read_from_buffer(buf, len, off, state->kernel_buffer, state->buffer_len);
+	mutex_unlock(&state->lock);
+	return count;
 }
 
 static ssize_t my_write(struct file *filp,const char __user *buf, size_t len, loff_t* off)
 {
-	if(copy_from_user(kernel_buffer, buf, len) != 0) return -EFAULT;
-	printk(KERN_INFO "Data is written successfully...\n");
-	return len;
+	struct my_file_state *state = filp->private_data;
+	ssize_t count;
+
+	mutex_lock(&state->lock);
+	//writes past the end of the buffer are cut short, never copied over it
+	count = simple_write_to_buffer(state->kernel_buffer, mem_size, off, buf, len);
+	if(count > 0 && *off > state->buffer_len) state->buffer_len = *off;
+	mutex_unlock(&state->lock);
+	if(count == 0 && len > 0) return -ENOSPC;
+	return count;
+}
+
+/*
+   Offset 0 maps the producer ring and can only be mapped read only, so user
+   space cannot touch head, capacity or the records. ringConsumerOffset maps
+   the page holding tail, the only field the reader writes.
+   */
+static int my_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct my_file_state *state = filp->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if(vma->vm_pgoff == ringConsumerOffset >> PAGE_SHIFT){
+		if(size > PAGE_SIZE) return -EINVAL;
+		return remap_vmalloc_range(vma, state->consumer, 0);
+	}
+	if(vma->vm_pgoff != 0 || size > ringSize) return -EINVAL;
+	if(vma->vm_flags & VM_WRITE) return -EPERM;
+	//mprotect must not be able to make it writable later
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return remap_vmalloc_range(vma, state->ring, 0);
+}
+
+/*
+   The node stays owned by root; group access is granted by 99-shellfyre.rules, installed
+   by make install, never to every local user.
+   */
+static char *my_devnode(MY_DEVNODE_DEVICE *dev, umode_t *mode)
+{
+	if(mode) *mode = 0660;
+	return NULL;
 }
 
 static int __init my_driver_init(void)
@@ -202,6 +448,9 @@ static int __init my_driver_init(void)
 		goto r_class;
 	}
 
+	/* letting udev create the node readable and writable by root and the device group */
+	dev_class->devnode = my_devnode;
+
 	/* creating device */
 
 	if((device_create(dev_class, NULL, dev, NULL, "my_device")) == NULL) {
@@ -1,3 +1,52 @@
 #include <linux/ioctl.h>
 #define READ_VAL _IOR('a', 'a', char **)
 #define WRITE_VAL _IOW('a', 'b', char **)
+#define AGGREGATE_VAL _IOWR('a', 'c', struct ps_totals)
+
+// shared result ring, mapped into user space with mmap on the device
+#define ringSize (64 * 1024)
+#define psCommLen 16
+
+struct ps_record
+{
+	int pid;
+	int ppid;
+	char comm[psCommLen];
+};
+
+// producer side, mapped read only at offset 0; the module keeps its own copy of
+// head and capacity and only publishes them here
+struct ps_ring
+{
+	unsigned int head;
+	unsigned int capacity;
+	unsigned int dropped;
+	unsigned int reserved;
+	struct ps_record records[];
+};
+
+// consumer side, a separate writable page mapped at ringConsumerOffset;
+// head and tail count records, not bytes
+#define ringConsumerOffset ringSize
+struct ps_ring_consumer
+{
+	unsigned int tail;
+};
+
+// task states are counted in the order of /proc/<pid>/stat: R S D T t X Z P I
+#define psStateCount 9
+
+// totals of a whole subtree, pid and depthFirst are filled by the caller and the rest by the module;
+// dropped counts children left out because the traversal queue was full, with their subtrees
+struct ps_totals
+{
+	int pid;
+	int depthFirst;
+	unsigned int dropped;
+	unsigned int tasks;
+	unsigned int threads;
+	unsigned long long rssPages;
+	unsigned long long utimeNs;
+	unsigned long long stimeNs;
+	unsigned int states[psStateCount];
+};
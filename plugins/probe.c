@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../shellfyre_plugin.h"
+
+/*
+   Example plugin with a status probe, build it with make plugins and run
+   load ./plugins/probe.so in shellfyre.
+   */
+
+const int shellfyre_plugin_abi = SHELLFYRE_PLUGIN_ABI;
+
+// prints the load averages, without starting cat for it
+static int runLoadavg(int argc, char **argv){
+	char buffer[128];
+	int fd = open("/proc/loadavg", O_RDONLY);
+	if(fd < 0) return 1;
+	ssize_t len = read(fd, buffer, sizeof(buffer));
+	close(fd);
+	if(len <= 0) return 1;
+	fwrite(buffer, 1, len, stdout);
+	return 0;
+}
+
+static const struct shellfyre_builtin loadavgBuiltin = {"loadavg", 0, 0, runLoadavg, "print the load averages"};
+
+int shellfyre_plugin_init(struct shellfyre_host *host){
+	return host->register_builtin(host, &loadavgBuiltin);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -11,22 +12,89 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
 #include "my_module_variables.h"
+#include "shellfyre_plugin.h"
 #include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <pwd.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/un.h>
 
 #define maxCommandSize 1024
 #define maxFolderCharSize 256
 #define maxSearchLength 128
 #define maxPokeLength 64
-#define pathLen 150
+#define maxPokemons 1024
+#define pokedexBuckets 2048
+#define maxPokeSuggestions 3
+#define pokedexFileName "pokemons.txt"
+#define pokemonArtUrl "http://www.fiikus.net/asciiart/pokemon/"
+#define defaultPrefetchWorkers 8
+#define fetchTimeoutSeconds 5
 #define maxHistory 100
+#define maxRecentShown 10
+#define maxDirectoryPath PATH_MAX
+#define maxDirStack 32
+#define maxTakeDepth 256
+#define maxGlobTokens 128
+#define maxGlobComponents 64
+#define globReadSize (64 * 1024)
 #define BUFFER_SIZE 25
 #define READ_END	0
 #define WRITE_END	1
+#define maxTraceEvents 65536
+#define maxTraceDetail 48
+#define defaultTraceFile "shellfyre-trace.json"
+#define builtinBuckets 128
+#define maxPlugins 32
+#define maxPluginBuiltins 16
+#define maxJobs 64
+#define maxJobNameLength 128
+#define maxPipelineStages 16
+#define variableBuckets 1024
+#define maxVariableName 64
+#define defaultParallelJobs 4
+#define defaultMemoLimit (64ULL * 1024 * 1024)
+#define memoMagic "shfmemo1"
+#define ioprioClassShift 13
+#define ioprioWhoProcess 1
+#define commandPathBuckets 8192
+#define maxServerLine (64 * 1024)
+#define serverBacklog 128
+#define aliasBuckets 256
+#define maxPromptSegments 64
+#define rcFileName ".shellfyrerc"
+#define startupCacheVersion "shellfyre-startup 2"
+#define serverRequestFds 4		// stdin, stdout, stderr and the working directory
+#define maxEveryJobs 32
+#define minEveryIntervalNs 1000000LL
+#define maxEveryIntervalNs ((INT_MAX / 1000) * 1000000000LL)
+#define jokerIntervalNs (15 * 60 * 1000000000LL)
+#define moduleName "my_module"
+#define modulePath "./my_module.ko"
+#define moduleDevice "/dev/my_device"
+#define moduleLockName "shellfyre-my_module.lock"
+#define moduleUdevRules "/etc/udev/rules.d/99-shellfyre.rules"
 
-static int victories, defeats, ties=0, recDirOpened = 0, modInstalled = 0;
-bool isJoker = false;
-static char currentFilePath[pathLen];
+static int victories, defeats, ties=0, recDirOpened = 0, modInstalled = 0, moduleLockFd = -1;
+static int jokerJobId = -1;
+static int lastStatus = 0;		// exit status of the last foreground command
+static bool startupProfile = false;
+static unsigned long long profileStart = 0;
+static char *currentFilePath = NULL;
 const char *sysname = "shellfyre", *fileName = "/recentDirectories.txt";
 
 /** Project 1 shellfyre by
@@ -52,6 +120,28 @@ struct command_t
 	struct command_t *next; // for piping
 };
 
+struct builtin_t
+{
+	const char *name;
+	int minArgs;
+	int maxArgs;			// -1 for no limit
+	bool pipeable;			// can run inside a pipeline
+	bool backgroundable;	// can run in the background with &
+	int (*handler)(struct command_t *command);
+	const char *help;
+	const struct shellfyre_builtin *external;	// set for builtins of loaded plugins
+	bool isolate;							// plugin builtin runs in a forked child
+};
+
+struct plugin_t
+{
+	char *path;
+	void *handle;
+	bool isolate;
+	int builtinCount;
+	struct builtin_t builtins[maxPluginBuiltins];
+};
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -101,19 +191,459 @@ int free_command(struct command_t *command)
 	return 0;
 }
 
+bool showPromptTemplate();
+
 /**
  * Show the command prompt
  * @return [description]
  */
 int show_prompt()
 {
-	char cwd[1024], hostname[1024];
+	if (showPromptTemplate())
+		return 0;
+	char hostname[1024];
 	gethostname(hostname, sizeof(hostname));
-	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+	char *cwd = getcwd(NULL, 0); // allocated, so long paths are not cut
+	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd ? cwd : "?", sysname);
+	free(cwd);
+	return 0;
+}
+
+struct glob_token_t
+{
+	char type;					// 'c' literal, '?' any char, '*' any string, '[' class
+	char literal;
+	bool negated;
+	unsigned char set[32];		// bitmap of the bytes a class matches
+};
+
+struct glob_pattern_t
+{
+	int count;
+	bool literal;				// no wildcards, used as it is
+	bool recursive;				// the ** component
+	bool dotFirst;				// matches hidden entries
+	struct glob_token_t tokens[maxGlobTokens];
+	char text[maxFolderCharSize];
+};
+
+struct glob_results_t
+{
+	char **paths;
+	int count;
+	int size;
+};
+
+/*
+   Compiles one path component of a glob into tokens, so directory entries are
+   matched without parsing the pattern again. Returns -1 for a too long component.
+   */
+int compileGlob(const char *text, size_t len, struct glob_pattern_t *pattern){
+	memset(pattern, 0, sizeof(*pattern));
+	if(len >= sizeof(pattern->text)) return -1;
+	memcpy(pattern->text, text, len);
+	pattern->recursive = len == 2 && text[0] == '*' && text[1] == '*';
+	pattern->literal = true;
+	pattern->dotFirst = text[0] == '.';
+
+	for(size_t i = 0; i < len; i++){
+		if(pattern->count == maxGlobTokens) return -1;
+		struct glob_token_t *token = &pattern->tokens[pattern->count++];
+		if(text[i] == '\\' && i + 1 < len){
+			token->type = 'c';
+			token->literal = text[++i];
+		}else if(text[i] == '*'){
+			//consecutive stars are a single one
+			if(pattern->count > 1 && token[-1].type == '*') pattern->count--;
+			token->type = '*';
+			pattern->literal = false;
+		}else if(text[i] == '?'){
+			token->type = '?';
+			pattern->literal = false;
+		}else if(text[i] == '[' && memchr(text + i + 1, ']', len - i - 1) != NULL){
+			size_t j = i + 1;
+			token->type = '[';
+			if(text[j] == '!' || text[j] == '^'){
+				token->negated = true;
+				j++;
+			}
+			//a ] right after the opening bracket is a member
+			for(bool first = true; j < len && (first || text[j] != ']'); j++, first = false){
+				unsigned char from = text[j], to = text[j];
+				if(j + 2 < len && text[j + 1] == '-' && text[j + 2] != ']'){
+					to = text[j + 2];
+					j += 2;
+				}
+				for(unsigned int c = from; c <= to; c++) token->set[c / 8] |= 1 << (c % 8);
+			}
+			if(j >= len) return -1;
+			i = j;
+			pattern->literal = false;
+		}else{
+			token->type = 'c';
+			token->literal = text[i];
+		}
+	}
 	return 0;
 }
 
+bool matchGlobToken(const struct glob_token_t *token, unsigned char c){
+	if(token->type == 'c') return token->literal == (char)c;
+	if(token->type == '?') return true;
+	bool member = (token->set[c / 8] >> (c % 8)) & 1;
+	return member != token->negated;
+}
+
+/*
+   Matches a name against compiled tokens, a star backtracks to the last star only,
+   which keeps matching linear in practice.
+   */
+bool matchGlob(const struct glob_pattern_t *pattern, const char *name){
+	int t = 0, starToken = -1;
+	const char *starName = NULL;
+
+	if(name[0] == '.' && !pattern->dotFirst) return false;
+	while(*name){
+		if(t < pattern->count && pattern->tokens[t].type == '*'){
+			starToken = t++;
+			starName = name;
+		}else if(t < pattern->count && matchGlobToken(&pattern->tokens[t], (unsigned char)*name)){
+			t++;
+			name++;
+		}else if(starToken != -1){
+			t = starToken + 1;
+			name = ++starName;
+		}else{
+			return false;
+		}
+	}
+	while(t < pattern->count && pattern->tokens[t].type == '*') t++;
+	return t == pattern->count;
+}
+
+struct linux_dirent64
+{
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+   Reads a whole directory with large getdents64 calls into one buffer, the records are then
+   used in place. Returns the number of bytes of records or -1.
+   */
+ssize_t readDirectory(const char *path, char **buffer){
+	size_t size = globReadSize, used = 0;
+	int fd = open(path[0] ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0) return -1;
+
+	*buffer = malloc(size);
+	while(1){
+		if(size - used < globReadSize / 2){
+			size *= 2;
+			*buffer = realloc(*buffer, size);
+		}
+		long len = syscall(SYS_getdents64, fd, *buffer + used, size - used);
+		if(len <= 0){
+			close(fd);
+			if(len == 0) return used;
+			free(*buffer);
+			*buffer = NULL;
+			return -1;
+		}
+		used += len;
+	}
+}
+
+void addGlobResult(struct glob_results_t *results, const char *path, size_t pathLength, const char *name){
+	if(results->count == results->size){
+		results->size = results->size ? results->size * 2 : 64;
+		results->paths = realloc(results->paths, sizeof(char *) * results->size);
+	}
+	//the final string is built once, it is moved into the arguments without another copy
+	size_t nameLen = strlen(name);
+	char *result = malloc(pathLength + nameLen + 1);
+	memcpy(result, path, pathLength);
+	memcpy(result + pathLength, name, nameLen + 1);
+	results->paths[results->count++] = result;
+}
+
+bool isDirectoryEntry(const char *path, struct linux_dirent64 *entry){
+	if(entry->d_type == DT_DIR) return true;
+	if(entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) return false;
+	char full[PATH_MAX];
+	struct stat st;
+	snprintf(full, sizeof(full), "%s%s", path, entry->d_name);
+	return stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void expandGlobFrom(char *path, size_t pathLength, struct glob_pattern_t *patterns, int index, int count, struct glob_results_t *results);
+
+/*
+   Matches the entries of the directory at path against pattern index, for the last
+   component the matches are results, otherwise the matching directories are entered.
+   */
+void matchDirectory(char *path, size_t pathLength, char *records, ssize_t recordsLen,
+		struct glob_pattern_t *patterns, int index, int count, struct glob_results_t *results){
+	for(ssize_t offset = 0; offset < recordsLen;){
+		struct linux_dirent64 *entry = (struct linux_dirent64 *)(records + offset);
+		offset += entry->d_reclen;
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		if(!matchGlob(&patterns[index], entry->d_name)) continue;
+
+		if(index == count - 1){
+			addGlobResult(results, path, pathLength, entry->d_name);
+			continue;
+		}
+		size_t nameLen = strlen(entry->d_name);
+		if(pathLength + nameLen + 2 >= PATH_MAX || !isDirectoryEntry(path, entry)) continue;
+		memcpy(path + pathLength, entry->d_name, nameLen);
+		path[pathLength + nameLen] = '/';
+		path[pathLength + nameLen + 1] = 0;
+		expandGlobFrom(path, pathLength + nameLen + 1, patterns, index + 1, count, results);
+		path[pathLength] = 0;
+	}
+}
+
+/*
+   Adds every visible entry below path at any depth, files included, for a trailing **.
+   */
+void addEntriesBelow(char *path, size_t pathLength, struct glob_results_t *results){
+	char *records;
+	ssize_t recordsLen = readDirectory(path, &records);
+	if(recordsLen < 0) return;
+
+	for(ssize_t offset = 0; offset < recordsLen;){
+		struct linux_dirent64 *entry = (struct linux_dirent64 *)(records + offset);
+		offset += entry->d_reclen;
+		if(entry->d_name[0] == '.') continue;
+		addGlobResult(results, path, pathLength, entry->d_name);
+		size_t nameLen = strlen(entry->d_name);
+		if(pathLength + nameLen + 2 >= PATH_MAX || !isDirectoryEntry(path, entry)) continue;
+		memcpy(path + pathLength, entry->d_name, nameLen);
+		path[pathLength + nameLen] = '/';
+		path[pathLength + nameLen + 1] = 0;
+		addEntriesBelow(path, pathLength + nameLen + 1, results);
+		path[pathLength] = 0;
+	}
+	free(records);
+}
+
+/*
+   Expands the components from index on, below path (which is empty or ends with a slash).
+   */
+void expandGlobFrom(char *path, size_t pathLength, struct glob_pattern_t *patterns, int index, int count, struct glob_results_t *results){
+	if(index == count){
+		//a trailing slash in the pattern only keeps directories
+		addGlobResult(results, path, pathLength, "");
+		return;
+	}
+
+	struct glob_pattern_t *pattern = &patterns[index];
+	if(pattern->literal){
+		size_t len = strlen(pattern->text);
+		if(pathLength + len + 2 >= PATH_MAX) return;
+		memcpy(path + pathLength, pattern->text, len + 1);
+		if(index == count - 1){
+			struct stat st;
+			if(lstat(path, &st) == 0) addGlobResult(results, path, pathLength + len, "");
+		}else{
+			path[pathLength + len] = '/';
+			path[pathLength + len + 1] = 0;
+			expandGlobFrom(path, pathLength + len + 1, patterns, index + 1, count, results);
+		}
+		path[pathLength] = 0;
+		return;
+	}
+
+	//a trailing ** matches the directory itself and everything below it, like bash globstar
+	if(pattern->recursive && index == count - 1){
+		if(pathLength > 0) addGlobResult(results, path, pathLength, "");
+		addEntriesBelow(path, pathLength, results);
+		return;
+	}
+
+	char *records;
+	ssize_t recordsLen = readDirectory(path, &records);
+	if(recordsLen < 0) return;
+
+	if(pattern->recursive){
+		//** matches no directory at all, or any number of visible ones
+		if(patterns[index + 1].literal){
+			expandGlobFrom(path, pathLength, patterns, index + 1, count, results);
+		}else{
+			//the next component is matched with the same directory read
+			matchDirectory(path, pathLength, records, recordsLen, patterns, index + 1, count, results);
+		}
+		for(ssize_t offset = 0; offset < recordsLen;){
+			struct linux_dirent64 *entry = (struct linux_dirent64 *)(records + offset);
+			offset += entry->d_reclen;
+			size_t nameLen = strlen(entry->d_name);
+			if(entry->d_name[0] == '.' || pathLength + nameLen + 2 >= PATH_MAX || !isDirectoryEntry(path, entry)) continue;
+			memcpy(path + pathLength, entry->d_name, nameLen);
+			path[pathLength + nameLen] = '/';
+			path[pathLength + nameLen + 1] = 0;
+			expandGlobFrom(path, pathLength + nameLen + 1, patterns, index, count, results);
+			path[pathLength] = 0;
+		}
+	}else{
+		matchDirectory(path, pathLength, records, recordsLen, patterns, index, count, results);
+	}
+	free(records);
+}
+
+int compareGlobResults(const void *first, const void *second){
+	return strcmp(*(char * const *)first, *(char * const *)second);
+}
+
+/*
+   Expands the wildcards *, ?, [...] and ** of an argument into the sorted list of
+   matching paths, appended to the arguments of command. Returns the number of
+   matches, when there is none the caller keeps the argument as it is.
+   */
+int expandGlob(const char *arg, struct command_t *command, int *arg_index){
+	struct glob_pattern_t *patterns = malloc(sizeof(struct glob_pattern_t) * maxGlobComponents);
+	struct glob_results_t results = {NULL, 0, 0};
+	char path[PATH_MAX];
+	int count = 0;
+	size_t pathLength = 0;
+
+	//an absolute pattern starts at the root
+	if(arg[0] == '/'){
+		path[pathLength++] = '/';
+		while(*arg == '/') arg++;
+	}
+	path[pathLength] = 0;
+
+	for(const char *component = arg; *component; ){
+		size_t len = strcspn(component, "/");
+		if(len > 0){
+			if(count == maxGlobComponents || compileGlob(component, len, &patterns[count]) != 0){
+				free(patterns);
+				return 0;
+			}
+			count++;
+		}
+		component += len;
+		while(*component == '/') component++;
+	}
+
+	if(count > 0) expandGlobFrom(path, pathLength, patterns, 0, count, &results);
+	free(patterns);
+	if(results.count == 0){
+		free(results.paths);
+		return 0;
+	}
+
+	qsort(results.paths, results.count, sizeof(char *), compareGlobResults);
+	command->args = (char **)realloc(command->args, sizeof(char *) * (*arg_index + results.count));
+	memcpy(command->args + *arg_index, results.paths, sizeof(char *) * results.count);
+	*arg_index += results.count;
+	free(results.paths);
+	return results.count;
+}
+
+/*
+   Cuts the next word out of the line at *cursor and moves the cursor after it.
+   Whitespace inside quotes or after a backslash does not end a word, the quotes
+   and backslashes stay in the word for removeQuotes. Returns NULL at the end of the line.
+   */
+char *nextWord(char **cursor){
+	char *p = *cursor, quote = 0;
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (*p == 0)
+		return NULL;
+
+	char *word = p;
+	for (; *p && (quote || (*p != ' ' && *p != '\t')); p++)
+	{
+		if (quote != '\'' && *p == '\\' && p[1] != 0)
+			p++;
+		else if (quote == 0 && (*p == '"' || *p == '\''))
+			quote = *p;
+		else if (*p == quote)
+			quote = 0;
+	}
+	if (*p)
+		*p++ = 0;
+	*cursor = p;
+	return word;
+}
+
+/*
+   Removes the quotes and backslash escapes of a word in place.
+   */
+void removeQuotes(char *word){
+	char *out = word, quote = 0;
+	for (char *p = word; *p; p++)
+	{
+		if (quote == 0 && (*p == '"' || *p == '\''))
+			quote = *p;
+		else if (*p == quote)
+			quote = 0;
+		else if (*p == '\\' && p[1] != 0 && (quote == 0 || (quote == '"' && strchr("\"\\$", p[1]) != NULL)))
+			*out++ = *++p;
+		else
+			*out++ = *p;
+	}
+	*out = 0;
+}
+
+/*
+   Finds the } closing the { at word and the top level commas between them.
+   Returns NULL when the group is not closed or has no comma, it is kept as it is then.
+   */
+const char *findBraceGroupEnd(const char *word, bool *hasComma){
+	int depth = 0;
+	*hasComma = false;
+	for(const char *p = word; *p; p++){
+		if(*p == '{') depth++;
+		else if(*p == ',' && depth == 1) *hasComma = true;
+		else if(*p == '}' && --depth == 0) return *hasComma ? p : NULL;
+	}
+	return NULL;
+}
+
+/*
+   Expands the first {a,b,...} group of a word, and then the groups of every alternative,
+   so a/{b,c}/{d,e} gives four words. Each word gets its wildcards expanded and is appended
+   to the arguments of command. Returns the number of words, 0 when there is no group.
+   */
+int expandBraces(const char *word, struct command_t *command, int *arg_index){
+	const char *open = word, *close = NULL;
+	bool hasComma;
+	for(; (open = strchr(open, '{')) != NULL; open++)
+		if((close = findBraceGroupEnd(open, &hasComma)) != NULL) break;
+	if(open == NULL){
+		if(strpbrk(word, "*?[") != NULL && expandGlob(word, command, arg_index) > 0) return 1;
+		command->args = (char **)realloc(command->args, sizeof(char *) * (*arg_index + 1));
+		command->args[(*arg_index)++] = strdup(word);
+		return 1;
+	}
+
+	size_t prefixLen = open - word, suffixLen = strlen(close + 1);
+	char *alternative = malloc(strlen(word) + 1);
+	int count = 0, depth = 0;
+	const char *start = open + 1;
+	for(const char *p = open + 1; p <= close; p++){
+		if(*p == '{') depth++;
+		else if(*p == '}' && depth > 0) depth--;
+		else if((*p == ',' && depth == 0) || p == close){
+			size_t len = p - start;
+			memcpy(alternative, word, prefixLen);
+			memcpy(alternative + prefixLen, start, len);
+			memcpy(alternative + prefixLen + len, close + 1, suffixLen + 1);
+			count += expandBraces(alternative, command, arg_index);
+			start = p + 1;
+		}
+	}
+	free(alternative);
+	return count;
+}
+
 /**
  * Parse a command string into a command struct
  * @param  buf     [description]
@@ -123,7 +653,7 @@ int show_prompt()
 int parse_command(char *buf, struct command_t *command)
 {
 	const char *splitters = " \t"; // split at whitespace
-	int index, len;
+	int len;
 	len = strlen(buf);
 	while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
 	{
@@ -133,60 +663,45 @@ int parse_command(char *buf, struct command_t *command)
 	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
 		buf[--len] = 0; // trim right whitespace
 
-	if (len > 0 && buf[len - 1] == '?') // auto-complete
+	bool escaped = len > 1 && buf[len - 2] == '\\';
+	if (len > 0 && buf[len - 1] == '?' && !escaped) // auto-complete
 		command->auto_complete = true;
-	if (len > 0 && buf[len - 1] == '&') // background
+	if (len > 0 && buf[len - 1] == '&' && !escaped) // background
 		command->background = true;
 
-	char *pch = strtok(buf, splitters);
-	command->name = (char *)malloc(strlen(pch) + 1);
+	char *cursor = buf;
+	char *pch = nextWord(&cursor);
 	if (pch == NULL)
-		command->name[0] = 0;
+		command->name = strdup("");
 	else
-		strcpy(command->name, pch);
+	{
+		removeQuotes(pch);
+		command->name = strdup(pch);
+	}
 
 	command->args = (char **)malloc(sizeof(char *));
 
 	int redirect_index;
 	int arg_index = 0;
-	char temp_buf[1024], *arg;
+	char *arg;
 
 	while (1)
 	{
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
+		// tokenize input on splitters, quoted whitespace stays in the word
+		pch = nextWord(&cursor);
 		if (!pch)
 			break;
-		arg = temp_buf;
-		strcpy(arg, pch);
+		arg = pch;
 		len = strlen(arg);
 
-		if (len == 0)
-			continue;										 // empty arg, go for next
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-		{
-			arg++;
-			len--;
-		}
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-			arg[--len] = 0; // trim right whitespace
-		if (len == 0)
-			continue; // empty arg, go for next
-
-		// piping to another command
+		// piping to another command, the rest of the line is its own command
 		if (strcmp(arg, "|") == 0)
 		{
 			struct command_t *c = malloc(sizeof(struct command_t));
-			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
-			index = 1;
-			while (pch[index] == ' ' || pch[index] == '\t')
-				index++; // skip whitespaces
-
-			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
+			memset(c, 0, sizeof(struct command_t)); // set all bytes to 0
+			parse_command(cursor, c);
 			command->next = c;
-			continue;
+			break;
 		}
 
 		// background process
@@ -210,25 +725,176 @@ int parse_command(char *buf, struct command_t *command)
 		}
 		if (redirect_index != -1)
 		{
-			command->redirects[redirect_index] = malloc(len);
-			strcpy(command->redirects[redirect_index], arg + 1);
+			removeQuotes(arg + 1);
+			command->redirects[redirect_index] = strdup(arg + 1);
 			continue;
 		}
 
 		// normal arguments
-		if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"') || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+		if (strpbrk(arg, "\"'\\") != NULL) // quoted or escaped arg, never a wildcard
+			removeQuotes(arg);
+		else if (strchr(arg, '{') != NULL)
 		{
-			arg[--len] = 0;
-			arg++;
+			expandBraces(arg, command, &arg_index); // alternatives get their wildcards expanded too
+			continue;
 		}
+		else if (strpbrk(arg, "*?[") != NULL && expandGlob(arg, command, &arg_index) > 0)
+			continue; // wildcards are expanded, unless nothing matches
 		command->args = (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-		command->args[arg_index] = (char *)malloc(len + 1);
-		strcpy(command->args[arg_index++], arg);
+		command->args[arg_index++] = strdup(arg);
 	}
 	command->arg_count = arg_index;
 	return 0;
 }
 
+struct trace_event_t
+{
+	const char *name;		// set last, a NULL name is a slot still being written
+	char phase;				// 'X' for a span, 'i' for an instant
+	int pid;
+	unsigned long long startNs;
+	unsigned long long durationNs;
+	char detail[maxTraceDetail];
+};
+
+struct trace_buffer_t
+{
+	unsigned int next;
+	unsigned int dropped;
+	struct trace_event_t events[maxTraceEvents];
+};
+
+// shared with forked children, so the events they record before exec end up in the same buffer
+static struct trace_buffer_t *traceBuffer = NULL;
+static char tracePath[PATH_MAX];
+
+unsigned long long traceNow(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// start time of a span, 0 when tracing is off so untraced runs skip the clock read
+unsigned long long traceBegin(){
+	return traceBuffer ? traceNow() : 0;
+}
+
+/*
+   Records an event. Slots are claimed with an atomic increment, so the shell and its
+   children can record at the same time without a lock.
+   */
+struct trace_event_t *traceClaim(){
+	unsigned int index = __atomic_fetch_add(&traceBuffer->next, 1, __ATOMIC_RELAXED);
+	if(index >= maxTraceEvents){
+		__atomic_fetch_add(&traceBuffer->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return &traceBuffer->events[index];
+}
+
+void traceRecord(const char *name, char phase, unsigned long long startNs, const char *detail){
+	//spans that began before tracing was turned on are skipped
+	if(traceBuffer == NULL || (phase == 'X' && startNs == 0)) return;
+	unsigned long long endNs = traceNow();
+	struct trace_event_t *event = traceClaim();
+	if(event == NULL) return;
+	event->phase = phase;
+	event->pid = getpid();
+	event->startNs = phase == 'X' ? startNs : endNs;
+	event->durationNs = phase == 'X' ? endNs - startNs : 0;
+	snprintf(event->detail, sizeof(event->detail), "%s", detail ? detail : "");
+	__atomic_store_n(&event->name, name, __ATOMIC_RELEASE);
+}
+
+void traceEnd(const char *name, unsigned long long startNs, const char *detail){
+	traceRecord(name, 'X', startNs, detail);
+}
+
+void traceInstant(const char *name, const char *detail){
+	traceRecord(name, 'i', 0, detail);
+}
+
+/*
+   Opens a span that ends where traceExtend was called last, for phases that end in an exec
+   and cannot record their end afterwards. Returns NULL when tracing is off.
+   */
+struct trace_event_t *traceOpen(const char *name, const char *detail){
+	if(traceBuffer == NULL) return NULL;
+	struct trace_event_t *event = traceClaim();
+	if(event == NULL) return NULL;
+	event->phase = 'X';
+	event->pid = getpid();
+	event->startNs = traceNow();
+	event->durationNs = 0;
+	snprintf(event->detail, sizeof(event->detail), "%s", detail);
+	__atomic_store_n(&event->name, name, __ATOMIC_RELEASE);
+	return event;
+}
+
+void traceExtend(struct trace_event_t *event, const char *detail){
+	if(event == NULL) return;
+	event->durationNs = traceNow() - event->startNs;
+	snprintf(event->detail, sizeof(event->detail), "%s", detail);
+}
+
+int traceStart(const char *path){
+	if(traceBuffer == NULL){
+		traceBuffer = mmap(NULL, sizeof(struct trace_buffer_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if(traceBuffer == MAP_FAILED){
+			traceBuffer = NULL;
+			return -1;
+		}
+	}
+	snprintf(tracePath, sizeof(tracePath), "%s", path);
+	return 0;
+}
+
+void writeJsonString(FILE *fp, const char *text){
+	fputc('"', fp);
+	for(; *text; text++){
+		if(*text == '"' || *text == '\\') fprintf(fp, "\\%c", *text);
+		else if((unsigned char)*text < 0x20) fprintf(fp, "\\u%04x", *text);
+		else fputc(*text, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+   Writes the recorded events as Chrome trace_event JSON (chrome://tracing, Perfetto) and stops tracing.
+   */
+int traceStop(){
+	if(traceBuffer == NULL) return 0;
+	FILE *fp = fopen(tracePath, "w");
+	if(fp == NULL){
+		printf("-%s: trace: %s: %s\n", sysname, tracePath, strerror(errno));
+		return -1;
+	}
+
+	unsigned int count = traceBuffer->next < maxTraceEvents ? traceBuffer->next : maxTraceEvents;
+	bool first = true;
+	fprintf(fp, "{\"traceEvents\":[");
+	for(unsigned int i = 0; i < count; i++){
+		struct trace_event_t *event = &traceBuffer->events[i];
+		const char *name = __atomic_load_n(&event->name, __ATOMIC_ACQUIRE);
+		if(name == NULL) continue;
+		fprintf(fp, "%s\n{\"name\":", first ? "" : ",");
+		writeJsonString(fp, name);
+		fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", sysname, event->phase, event->startNs / 1000.0);
+		if(event->phase == 'X') fprintf(fp, "\"dur\":%.3f,", event->durationNs / 1000.0);
+		else fprintf(fp, "\"s\":\"t\",");
+		fprintf(fp, "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":", event->pid, event->pid);
+		writeJsonString(fp, event->detail);
+		fprintf(fp, "}}");
+		first = false;
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%u}}\n", traceBuffer->dropped);
+	fclose(fp);
+
+	munmap(traceBuffer, sizeof(struct trace_buffer_t));
+	traceBuffer = NULL;
+	return 0;
+}
+
 void prompt_backspace()
 {
 	putchar(8);	  // go back 1
@@ -236,6 +902,127 @@ void prompt_backspace()
 	putchar(8);	  // go back 1 again
 }
 
+int readKey();
+void reapChildren();
+int process_command(struct command_t *command);
+int expandAndParse(const char *line, struct command_t *command);
+const char *getVariable(const char *name);
+char *applyAliases(const char *line);
+const struct builtin_t *findBuiltin(const char *name);
+
+void addBuiltinCompletions(const char *prefix, struct glob_results_t *results);
+
+/*
+   Adds the entries of directory (empty or ending with a slash) that start with prefix, only
+   executable files for a command name. Directories get a trailing slash.
+   */
+void addDirectoryCompletions(const char *directory, const char *prefix, bool executables, struct glob_results_t *results){
+	char *records, name[NAME_MAX + 2], full[PATH_MAX];
+	size_t prefixLen = strlen(prefix);
+	ssize_t recordsLen = readDirectory(directory, &records);
+	if(recordsLen < 0) return;
+
+	for(ssize_t offset = 0; offset < recordsLen;){
+		struct linux_dirent64 *entry = (struct linux_dirent64 *)(records + offset);
+		offset += entry->d_reclen;
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		//hidden entries are only offered when the prefix asks for them
+		if(strncmp(entry->d_name, prefix, prefixLen) != 0 || (entry->d_name[0] == '.' && prefix[0] != '.')) continue;
+
+		if(executables){
+			struct stat st;
+			snprintf(full, sizeof(full), "%s%s", directory, entry->d_name);
+			if(access(full, X_OK) != 0 || stat(full, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+			addGlobResult(results, "", 0, entry->d_name);
+		}else{
+			snprintf(name, sizeof(name), "%s%s", entry->d_name, isDirectoryEntry(directory, entry) ? "/" : "");
+			addGlobResult(results, "", 0, name);
+		}
+	}
+	free(records);
+}
+
+/*
+   Completes the word before the cursor on Tab: the first word of a command against the
+   builtins and the commands of PATH, the other words against file names. The word is
+   extended to the longest prefix shared by the matches, a single match also gets a space.
+   When there is nothing to add the matches are listed under the line. Returns the new index.
+   */
+int completeWord(char *buf, int index, int size){
+	struct glob_results_t results = {NULL, 0, 0};
+	char directory[PATH_MAX];
+
+	buf[index] = 0;
+	int wordStart = index;
+	while(wordStart > 0 && buf[wordStart - 1] != ' ' && buf[wordStart - 1] != '\t' && buf[wordStart - 1] != '|') wordStart--;
+	int before = wordStart;
+	while(before > 0 && (buf[before - 1] == ' ' || buf[before - 1] == '\t')) before--;
+	bool commandName = before == 0 || buf[before - 1] == '|';
+
+	char *word = buf + wordStart, *slash = strrchr(word, '/');
+	const char *prefix = slash ? slash + 1 : word;
+	if(commandName && slash == NULL){
+		addBuiltinCompletions(prefix, &results);
+		const char *path = getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin";
+		for(const char *entry = path; *entry;){
+			size_t len = strcspn(entry, ":");
+			if(len > 0 && len + 2 < sizeof(directory)){
+				snprintf(directory, sizeof(directory), "%.*s/", (int)len, entry);
+				addDirectoryCompletions(directory, prefix, true, &results);
+			}
+			entry += len;
+			if(*entry == ':') entry++;
+		}
+	}else{
+		snprintf(directory, sizeof(directory), "%.*s", slash ? (int)(slash - word + 1) : 0, word);
+		addDirectoryCompletions(directory, prefix, false, &results);
+	}
+
+	if(results.count == 0){
+		putchar('\a');
+		free(results.paths);
+		return index;
+	}
+
+	//a command may be both a builtin and in several PATH directories
+	qsort(results.paths, results.count, sizeof(char *), compareGlobResults);
+	int unique = 1;
+	for(int i = 1; i < results.count; i++){
+		if(strcmp(results.paths[i], results.paths[unique - 1]) == 0) free(results.paths[i]);
+		else results.paths[unique++] = results.paths[i];
+	}
+	results.count = unique;
+
+	size_t common = strlen(results.paths[0]), typed = strlen(prefix);
+	for(int i = 1; i < results.count; i++){
+		size_t same = 0;
+		while(same < common && results.paths[i][same] == results.paths[0][same]) same++;
+		common = same;
+	}
+
+	if(common > typed || results.count == 1){
+		for(size_t i = typed; i < common && index < size - 2; i++){
+			buf[index++] = results.paths[0][i];
+			putchar(results.paths[0][i]);
+		}
+		if(results.count == 1 && buf[index - 1] != '/' && index < size - 2){
+			buf[index++] = ' ';
+			putchar(' ');
+		}
+	}else{
+		printf("\n");
+		for(int i = 0; i < results.count; i++)
+			printf("%s%s", results.paths[i], i + 1 < results.count ? "  " : "\n");
+		buf[index] = 0;
+		show_prompt();
+		printf("%s", buf);
+	}
+
+	for(int i = 0; i < results.count; i++) free(results.paths[i]);
+	free(results.paths);
+	return index;
+}
+
 /**
  * Prompt a command from the user
  * @param  buf      [description]
@@ -244,7 +1031,7 @@ void prompt_backspace()
  */
 int prompt(struct command_t *command)
 {
-	int index = 0;
+	int index = 0, key;
 	char c;
 	char buf[4096];
 	static char oldbuf[4096];
@@ -263,19 +1050,27 @@ int prompt(struct command_t *command)
 	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 
 	// FIXME: backspace is applied before printing chars
+	reapChildren();
 	show_prompt();
+	unsigned long long readStart = traceBegin();
 	int multicode_state = 0;
 	buf[0] = 0;
 
 	while (1)
 	{
-		c = getchar();
+		key = readKey();
+		if (key == EOF) // stdin closed, same as Ctrl+D
+		{
+			tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			return EXIT;
+		}
+		c = key;
 		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
 
 		if (c == 9) // handle tab
 		{
-			buf[index++] = '?'; // autocomplete
-			break;
+			index = completeWord(buf, index, sizeof(buf));
+			continue;
 		}
 
 		if (c == 127) // handle backspace
@@ -325,26 +1120,74 @@ int prompt(struct command_t *command)
 		if (c == 4) // Ctrl+D
 			return EXIT;
 	}
+	// restore the old settings, $(...) children must not inherit the raw mode
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+
 	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
 		index--;
 	buf[index++] = 0; // null terminate string
 
 	strcpy(oldbuf, buf);
+	traceEnd("prompt", readStart, NULL);
 
-	parse_command(buf, command);
+	unsigned long long parseStart = traceBegin();
+	expandAndParse(buf, command);
+	traceEnd("parse_command", parseStart, command->name);
 
 	// print_command(command); // DEBUG: uncomment for debugging
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
 	return SUCCESS;
 }
 
-int process_command(struct command_t *command);
+void registerDefaultBuiltins();
+int runServer(const char *configured);
+void loadStartupConfig();
+void profilePhase(const char *phase);
+int runClient(const char *configured, char **words, int wordCount);
 
-int main()
+// the benchmarks include this file and bring their own main
+#ifndef SHELLFYRE_NO_MAIN
+int main(int argc, char **argv)
 {
+	//the client only talks to the server, it sets up nothing of the shell
+	if (argc > 1 && strcmp(argv[1], "--client") == 0)
+	{
+		bool socketGiven = argc > 3 && strcmp(argv[2], "-s") == 0;
+		if (argc < (socketGiven ? 5 : 3))
+		{
+			fprintf(stderr, "usage: %s --client [-s socket] <command line | words...>\n", argv[0]);
+			return 2;
+		}
+		return runClient(socketGiven ? argv[3] : NULL, argv + (socketGiven ? 4 : 2), argc - (socketGiven ? 4 : 2));
+	}
+
+	//--startup-profile prints how long each phase of the start takes
+	bool serverMode = false;
+	const char *serverSocket = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--startup-profile") == 0)
+			startupProfile = true;
+		else if (strcmp(argv[i], "--server") == 0)
+		{
+			serverMode = true;
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				serverSocket = argv[++i];
+		}
+	}
+	unsigned long long startupStart = profileStart = traceNow();
+
 	srand(time(0));
+	registerDefaultBuiltins();
+	profilePhase("registry");
+	loadStartupConfig();
+	if (startupProfile)
+		fprintf(stderr, "startup.total %.3f ms\n", (traceNow() - startupStart) / 1e6);
+	if (serverMode)
+		return runServer(serverSocket);
+	//SHELLFYRE_TRACE=file traces the whole session
+	if (getenv("SHELLFYRE_TRACE") != NULL)
+		traceStart(getenv("SHELLFYRE_TRACE"));
 	while (1)
 	{
 		struct command_t *command = malloc(sizeof(struct command_t));
@@ -363,9 +1206,11 @@ int main()
 		free_command(command);
 	}
 
+	traceStop();
 	printf("\n");
 	return 0;
 }
+#endif
 void executeFilesearch(struct command_t *command, char *starterDirectory, char *searchedString){
 	//Getting current directory
 
@@ -425,44 +1270,116 @@ void executeFilesearch(struct command_t *command, char *starterDirectory, char *
 void initializeFilePath(){
 	//this function should be called when first cd or take is executed before changing directories
 	//it initializes the path of the file that records of visited directories are kept
-	char currentDirectory[128];
-	getcwd(currentDirectory, sizeof(currentDirectory));
+	char *currentDirectory = getcwd(NULL, 0);
+	if(currentDirectory == NULL) return;
+	free(currentFilePath);
+	currentFilePath = malloc(strlen(currentDirectory) + strlen(fileName) + 1);
 	strcpy(currentFilePath, currentDirectory);
 	strcat(currentFilePath, fileName);
+	free(currentDirectory);
 	recDirOpened = 1;
 }
-void updateRecentDirectories(){
-	//this function updates the visited directories whenever cd, cdh or take is called
-	//appends the most recent directory to the txt file
-	char currentDirectory[128];
 
-	getcwd(currentDirectory, sizeof(currentDirectory));
-
-	FILE *fp = fopen(currentFilePath, "a");
+// O_PATH handles of the recently visited directories, to go back to them without a path lookup
+struct dir_handle_t
+{
+	char *path;				// path at the time of the visit, NULL for an unused slot
+	int fd;
+};
 
-	if(fp){
-		//saving current working directory 	
-		fprintf(fp, "%s\n", currentDirectory);
+static struct dir_handle_t recentHandles[maxRecentShown];
+static int nextRecentHandle = 0;
 
-	}else{
+int openDirectoryHandle(const char *path){
+	return open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
 
-		printf("Cannot open the file");
-		exit(-1);
+/*
+   Keeps a handle of the current directory under its path, replacing the oldest one.
+   */
+void rememberDirectory(const char *path){
+	struct dir_handle_t *handle = NULL;
+	for(int i = 0; i < maxRecentShown && handle == NULL; i++)
+		if(recentHandles[i].path != NULL && strcmp(recentHandles[i].path, path) == 0) handle = &recentHandles[i];
+	if(handle == NULL){
+		handle = &recentHandles[nextRecentHandle];
+		nextRecentHandle = (nextRecentHandle + 1) % maxRecentShown;
+		if(handle->path != NULL) close(handle->fd);
+		free(handle->path);
+		handle->path = strdup(path);
+	}else close(handle->fd);
+	handle->fd = openDirectoryHandle(".");
+}
 
-	}
+/*
+   Switches to a directory handle with fchdir, which resolves no path and still works
+   when the directory was renamed. Removed directories are not entered.
+   */
+int changeToHandle(int fd){
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0) return -1;
+	if(st.st_nlink == 0){
+		errno = ENOENT;
+		return -1;
+	}
+	return fchdir(fd);
+}
+
+/*
+   Changes to a directory of the history, through its handle when there is one.
+   */
+int changeDirectory(const char *path){
+	for(int i = 0; i < maxRecentShown; i++)
+		if(recentHandles[i].path != NULL && strcmp(recentHandles[i].path, path) == 0 && changeToHandle(recentHandles[i].fd) == 0)
+			return 0;
+	return chdir(path);
+}
+void updateRecentDirectories(){
+	//this function updates the visited directories whenever cd, cdh or take is called
+	//appends the most recent directory to the txt file
+	char *currentDirectory = getcwd(NULL, 0);
+	if(currentDirectory == NULL) return;
+	rememberDirectory(currentDirectory);
+
+	FILE *fp = fopen(currentFilePath, "a");
+
+	if(fp){
+		//saving current working directory 	
+		fprintf(fp, "%s\n", currentDirectory);
+		free(currentDirectory);
+
+	}else{
+
+		printf("Cannot open the file");
+		exit(-1);
+
+	}
 
 	fclose(fp);
 
 }
 
+/*
+   Reads the last maxRecentShown directories of the history file, oldest first.
+   Only that window is kept while reading, so the file can grow to any length.
+   */
+int loadRecentDirectories(FILE *fp, char visitHistory[][maxDirectoryPath]){
+	static char window[maxRecentShown][maxDirectoryPath];
+	int total = 0;
+	while(fgets(window[total % maxRecentShown], maxDirectoryPath, fp)) total++;
+
+	int size = total < maxRecentShown ? total : maxRecentShown;
+	for(int i = 0; i < size; i++) strcpy(visitHistory[i], window[(total - size + i) % maxRecentShown]);
+	return size;
+}
+
 void executeCdh(){
 	char write_msg[BUFFER_SIZE];
 	char read_msg[BUFFER_SIZE];
 	pid_t pid;
 	int fd[2];
-	char visitHistory[maxHistory][maxFolderCharSize];
+	static char visitHistory[maxRecentShown][maxDirectoryPath];
 	int size = 0;
-	char buffer[maxFolderCharSize];
 	FILE *fp;
 
 	//creating pipe to transfer user choice to parrent
@@ -482,11 +1399,8 @@ void executeCdh(){
 		printf("No history\n");
 
 	}else{
-		//traversing visit history and recording them to a 2D array
-		while (fgets(buffer, maxFolderCharSize, fp)){
-			strcpy(visitHistory[size], buffer);
-			size++;
-		}
+		//recording the end of the visit history to a 2D array
+		size = loadRecentDirectories(fp, visitHistory);
 		int choice;
 		int index = size - 10;
 		int listNumber = 10;
@@ -530,12 +1444,12 @@ void executeCdh(){
 
 			}
 
-			if(choice <= 10){
+			if(choice >= 1 && choice <= size){
 
 				//removing \n at the end of the line
 				visitHistory[size - choice][strlen(visitHistory[size - choice]) - 1] = 0;
 				//switching to the selected directory
-				chdir(visitHistory[size - choice]);
+				changeDirectory(visitHistory[size - choice]);
 				updateRecentDirectories();
 
 			}else{
@@ -550,364 +1464,3827 @@ void executeCdh(){
 }
 
 
-void executeTake(struct command_t *command){
+// a directory of the path take is creating, with the handle new subdirectories are made in
+struct take_level_t
+{
+	char *name;
+	int fd;
+};
 
-	char *input = command->args[0];
-	char *token;
-	token= strtok(input,"/");
-
-	while(token != NULL){
-		DIR* dir = opendir(token);
-		if(ENOENT == errno) {
-			mkdir(token, 0777);
-		} 
-		chdir(token);
-		token= strtok(NULL, "/");
-		if(recDirOpened == 0) initializeFilePath();
-		updateRecentDirectories();
+void releaseTakeLevels(struct take_level_t *levels, int keep, int *depth){
+	while(*depth > keep){
+		(*depth)--;
+		close(levels[*depth].fd);
+		free(levels[*depth].name);
 	}
 }
 
-
 /*
-  The notify-send usage with crontab was adapted from stackoverflow, provided by the TA on the discussion board.
-  Disables joker given the -r option.
-  */
-void executeJoker(struct command_t *command){
-	char com[40];
-	if(command->args[0] != NULL){
-	if(strcmp(command->args[0], "-r")==0){
-		strcpy(com, "crontab -r");
-		system(com);
-		isJoker=false;}
-	}else if(command->arg_count==0){
-	FILE *fp;
-	fp= fopen("cron.txt","w");
-	fprintf(fp, " */15 * * * *  XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send -i face-laugh \"$(curl -s https://icanhazdadjoke.com/)\" \n" );
-	fclose(fp);
-	strcpy(com, "crontab cron.txt");
-	system(com);
-	isJoker=true;
-	}else{printf("Insufficient arguments");}
-}
-
-/* 
-   This command displays the pixel art of given pokemon by executing curl command.
-   Only 134 pokemons on the txt file are drawable.
+   take <path...> creates the directories of every path and enters the path when only one is given.
+   Paths that exist are skipped with one lookup. Missing directories are made with mkdirat in the
+   handle of their parent, and the handles are kept for the next path with the same leading
+   directories, so take proj/{src,include,test}/v1 resolves proj once. When a path fails, the
+   directories this take created are removed again. The history file is written once.
    */
-int executePokemon(struct command_t *command){
-
-	char *filename = "pokemons.txt";
-	FILE *fp = fopen(filename, "r");
-	bool pokemonFound = false;
-	if (fp == NULL){
-		printf("Error: could not open file %s", filename);
-		return 1;
-	}
+void executeTake(struct command_t *command){
+	struct take_level_t levels[maxTakeDepth];
+	char **created = NULL;
+	int depth = 0, createdCount = 0, rootFd = -1, targetFd = -1;
+	bool chainAbsolute = false, failed = false;
 
-	char buffer[maxPokeLength];
-	char searchedItem[maxPokeLength];
-	strcpy(searchedItem, command->args[0]);
-	strcat(searchedItem, "\n");
+	for(int i = 0; i < command->arg_count && !failed; i++){
+		const char *path = command->args[i];
+		bool last = i == command->arg_count - 1;
+		int existing = openDirectoryHandle(path);
+		if(existing >= 0){
+			if(last) targetFd = existing;
+			else close(existing);
+			continue;
+		}
 
-	char artUrl[maxSearchLength];
-	char curlCommand[maxCommandSize];
-	strcpy(curlCommand, "curl ");
-	strcpy(artUrl, "http://www.fiikus.net/asciiart/pokemon/");
+		//handles are only shared between paths relative to the same directory
+		bool absolute = path[0] == '/';
+		if(absolute != chainAbsolute){
+			releaseTakeLevels(levels, 0, &depth);
+			chainAbsolute = absolute;
+		}
+		if(absolute && rootFd < 0) rootFd = openDirectoryHandle("/");
+		int base = absolute ? rootFd : AT_FDCWD;
 
-	while (fgets(buffer, maxPokeLength, fp) && !pokemonFound){
+		char *copy = strdup(path), *saveptr = NULL;
+		int level = 0;
+		for(char *name = strtok_r(copy, "/", &saveptr); name != NULL; name = strtok_r(NULL, "/", &saveptr)){
+			if(level < depth && strcmp(levels[level].name, name) == 0){
+				level++;
+				continue;
+			}
+			releaseTakeLevels(levels, level, &depth);
+			if(depth == maxTakeDepth){
+				errno = ENAMETOOLONG;
+				failed = true;
+				break;
+			}
 
-		if(strcasecmp(searchedItem, buffer+5) == 0){
-			strncat(artUrl, &buffer[1], 1);
-			strncat(artUrl, &buffer[2], 1);
-			strncat(artUrl, &buffer[3], 1);
-			strcat(artUrl, ".txt");
-			strcat(curlCommand, artUrl);
-			system(curlCommand);
-			printf("\n");
-			pokemonFound = true; 
+			int parent = level > 0 ? levels[level - 1].fd : base;
+			if(mkdirat(parent, name, 0777) == 0){
+				created = realloc(created, sizeof(char *) * (createdCount + 1));
+				created[createdCount++] = strndup(path, name - copy + strlen(name));
+			}else if(errno != EEXIST){
+				failed = true;
+				break;
+			}
+			int fd = openat(parent, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+			if(fd < 0){
+				failed = true;
+				break;
+			}
+			levels[depth].name = strdup(name);
+			levels[depth].fd = fd;
+			depth++;
+			level++;
 		}
+		free(copy);
 
+		if(failed) printf("-%s: %s: %s: %s\n", sysname, command->name, path, strerror(errno));
+		else if(last && level > 0) targetFd = dup(levels[level - 1].fd);
 	}
-	if(!pokemonFound) printf("Pokemon not found\n");
-	fclose(fp);
-	return 0;
+	releaseTakeLevels(levels, 0, &depth);
+	if(rootFd >= 0) close(rootFd);
+
+	//removing what was created, deepest first
+	for(int i = createdCount - 1; i >= 0; i--){
+		if(failed) rmdir(created[i]);
+		free(created[i]);
+	}
+	free(created);
+
+	if(failed){
+		lastStatus = 1;
+	}else if(command->arg_count == 1 && targetFd >= 0){
+		if(recDirOpened == 0) initializeFilePath();
+		if(fchdir(targetFd) == 0) updateRecentDirectories();
+	}
+	if(targetFd >= 0) close(targetFd);
 }
 
+
+struct every_job_t
+{
+	int id;
+	int timerFd;
+	long long intervalNs;
+	unsigned long runs;
+	char *commandLine;		// command to run, or NULL when callback is set
+	void (*callback)(void);
+};
+
+// periodic jobs of the every command, each one has its own timerfd polled by readKey and waitForChild
+static struct every_job_t everyJobs[maxEveryJobs];
+static int everyJobCount = 0, nextEveryId = 1;
+
 /*
-   This command randomly picks rock paper scissors and plays with the user, then displays the # of wins, losses and ties.
-   Takes arguments "rock", "paper" or "scissors", case insensitive.
+   Parses intervals like 500ms, 1.5s, 10m, 2h or a plain number of seconds.
+   Intervals longer than INT_MAX / 1000 seconds are rejected rather than overflowing.
    */
-void executeRps(struct command_t *command){
-	int random = rand() % 3;
-	printf("Here we go! 3\n");
-	sleep(1);
-	printf("2\n");
-	sleep(1);
-	printf("1...\n");
-	sleep(1);
-	if(random==0){
-		printf("SHOOT!\n"
-				"    _______\n"
-				"---'   ____)\n"
-				"      (_____)\n"
-				"      (_____)\n"
-				"      (____)\n"
-				"---.__(___)\n"
-				"\n");
-		if(strcasecmp("rock", command->args[0]) == 0){
-			printf("Rock? We tied.\n");
-			ties++; }
-		else if(strcasecmp("paper", command->args[0]) == 0){
-			printf("Paper? You win...\n");
-			victories++; }
-		else if(strcasecmp("scissors", command->args[0]) == 0){
-			printf("Scissors? Smashed you!\n");
-			defeats++; }
-		else{ printf("You gave an incorrect argument! Try rock, paper or scissors!\n"); }
-		printf("Times you won: %d\nTimes I won: %d\nTies: %d\n", victories, defeats, ties);
-	}
-	else if(random==1){
-		printf("SHOOT!\n"
-				"     _______\n"
-				"---'    ____)____\n"
-				"           ______)\n"
-				"          _______)\n"
-				"         _______)\n"
-				"---.__________)\n"
-				"\n");       
-		if(strcasecmp("rock", command->args[0]) == 0){
-			printf("Rock? I won!\n");
-			defeats++; }
-		else if(strcasecmp("paper", command->args[0]) == 0){
-			printf("Paper? Tied.\n");
-			ties++; }
-		else if(strcasecmp("scissors", command->args[0]) == 0){
-			printf("Scissors? Damn, you won.\n");
-			victories++; }
-		else{ printf("You gave an incorrect argument! Try rock, paper or scissors!\n"); }
-		printf("Times you won: %d\nTimes I won: %d\nTies: %d\n", victories, defeats, ties);
-	}
-	else if(random==2){
-		printf("SHOOT!\n"
-				"    _______	\n"
-				"---'   ____)____\n"
-				"          ______)\n"
-				"       __________)\n"
-				"      (____)\n"
-				"---.__(___)\n"
-				"\n");
-		if(strcasecmp("rock", command->args[0]) == 0){
-			printf("Rock? Dang, you won...\n");
-			victories++; }
-		else if(strcasecmp("paper", command->args[0]) == 0){
-			printf("Paper? Hah, sliced you!\n");
-			defeats++; }
-		else if(strcasecmp("scissors", command->args[0]) == 0){
-			printf("Scissors? Tied.\n");
-			ties++; }
-		else{ printf("You gave an incorrect argument! Try rock, paper or scissors!\n"); }
-		printf("Times you won: %d\nTimes I won: %d\nTies: %d\n", victories, defeats, ties);
-	}
+int parseInterval(const char *text, long long *intervalNs){
+	char *unit;
+	double value = strtod(text, &unit);
+	double scale;
+
+	//also rejects nan
+	if(unit == text || !(value > 0)) return -1;
+	if(*unit == 0 || strcmp(unit, "s") == 0) scale = 1e9;
+	else if(strcmp(unit, "ms") == 0) scale = 1e6;
+	else if(strcmp(unit, "m") == 0) scale = 60e9;
+	else if(strcmp(unit, "h") == 0) scale = 3600e9;
+	else return -1;
 
+	if(value * scale > maxEveryIntervalNs) return -1;
+	*intervalNs = (long long)(value * scale);
+	return *intervalNs >= minEveryIntervalNs ? 0 : -1;
 }
 
-void executePstraverse(struct command_t *command){
+void printInterval(long long intervalNs){
+	if(intervalNs % 3600000000000LL == 0) printf("%lldh", intervalNs / 3600000000000LL);
+	else if(intervalNs % 60000000000LL == 0) printf("%lldm", intervalNs / 60000000000LL);
+	else if(intervalNs % 1000000000LL == 0) printf("%llds", intervalNs / 1000000000LL);
+	else printf("%lldms", intervalNs / 1000000LL);
+}
 
-	int check;
-	int fd;
-	char *parameters1[] = {"/usr/bin/sudo", "/usr/sbin/insmod", "./my_module.ko", NULL};
-	char *parameters2[] = {"/usr/bin/sudo", "/usr/bin/chmod", "777", "/dev/my_device", NULL};
+/*
+   Starts a periodic job, returns its id or -1.
+   */
+int addEveryJob(long long intervalNs, const char *commandLine, void (*callback)(void)){
+	if(everyJobCount == maxEveryJobs) return -1;
 
-	//if mod is uninstalled, installs it in the first call
-	if(modInstalled == 0){
-		pid_t pid = fork();
-		if(pid == 0){//child
-			execv(parameters1[0], parameters1);
-			exit(0);
-		}else if(pid > 0){//parent
-			wait(NULL);
-			pid_t pid = fork();
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0) return -1;
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = intervalNs / 1000000000LL;
+	spec.it_interval.tv_nsec = intervalNs % 1000000000LL;
+	spec.it_value = spec.it_interval;
+	if(timerfd_settime(fd, 0, &spec, NULL) != 0){
+		close(fd);
+		return -1;
+	}
 
-			if(pid == 0){//child
-				execv(parameters2[0], parameters2);
-				exit(0);
-			}else if(pid > 0){//parent
-				wait(NULL);
-			}
+	struct every_job_t *job = &everyJobs[everyJobCount++];
+	job->id = nextEveryId++;
+	job->timerFd = fd;
+	job->intervalNs = intervalNs;
+	job->runs = 0;
+	job->commandLine = commandLine ? strdup(commandLine) : NULL;
+	job->callback = callback;
+	return job->id;
+}
 
-		}
-		modInstalled = 1;	
-	}
-	fd = open("/dev/my_device", O_RDWR);
-	if(fd < 0){
-		printf("Failed to open device, errno = %d %s\n",errno,strerror(errno));
-		exit(-1);
-	}
-	//writing the given PID to the device
-	check = ioctl(fd, WRITE_VAL, &command->args);
-	if (check == -1){
-		printf("Failed to execute ioctl, errno = %d %s\n", errno, strerror(errno));
-		exit(-1);
+int removeEveryJob(int id){
+	for(int i = 0; i < everyJobCount; i++){
+		if(everyJobs[i].id != id) continue;
+		close(everyJobs[i].timerFd);
+		free(everyJobs[i].commandLine);
+		everyJobs[i] = everyJobs[--everyJobCount];
+		return 0;
 	}
-
-	close(fd);
+	return -1;
 }
 
-int process_command(struct command_t *command)
+struct job_t
 {
-	int r;
-	if (strcmp(command->name, "") == 0)
-		return SUCCESS;
+	int id;				// 0 for a free slot
+	int pidCount;
+	int running;
+	bool quiet;			// started by every, not reported when done
+	pid_t pids[maxPipelineStages];
+	char name[maxJobNameLength];
+};
 
-	if (strcmp(command->name, "exit") == 0){
-		//if a kernel module is installed before, deletes it before exiting from shell
-		if(modInstalled == 1){
-			char *parameters3[] = {"/usr/bin/sudo", "/usr/sbin/rmmod", "./my_module.ko", NULL};
-			pid_t pid = fork();
-			if(pid == 0){
-				execv(parameters3[0], parameters3);
-				exit(0);
-			}else if(pid > 0){
-				wait(NULL);
-			}
+// background pipelines, builtins included, until all of their processes exit
+static struct job_t jobs[maxJobs];
+static bool periodicLaunch = false;
 
-		}
-		if(isJoker){
-                	char com[40];
-                	strcpy(com, "crontab -r");
-               		system(com);
-			isJoker=false;}
-		return EXIT;
+// output capture of memo: the last stage of a foreground pipeline writes into captureWriteFd,
+// and the shell copies what arrives on captureReadFd to its stdout and to captureFileFd
+static int captureWriteFd = -1, captureReadFd = -1, captureFileFd = -1;
+static bool captureFailed = false;
+static unsigned long long captureLen = 0;
+
+/*
+   Records a background pipeline, returns its job id or -1 when the table is full.
+   */
+int addJob(pid_t *pids, int pidCount, const char *name, bool quiet){
+	int id = 1;
+	for(int i = 0; i < maxJobs; i++)
+		if(jobs[i].id >= id) id = jobs[i].id + 1;
+	for(int i = 0; i < maxJobs; i++){
+		if(jobs[i].id != 0) continue;
+		jobs[i].id = id;
+		jobs[i].pidCount = pidCount;
+		jobs[i].running = pidCount;
+		jobs[i].quiet = quiet;
+		memcpy(jobs[i].pids, pids, sizeof(pid_t) * pidCount);
+		snprintf(jobs[i].name, sizeof(jobs[i].name), "%s", name);
+		return id;
 	}
-	if (strcmp(command->name, "cd") == 0)
-	{
-		if (command->arg_count > 0)
-		{	
-			if(recDirOpened == 0) initializeFilePath();
-			r = chdir(command->args[0]);
-			updateRecentDirectories();
-			if (r == -1)
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			return SUCCESS;
+	return -1;
+}
+
+/*
+   Reaps finished background processes, so they don't stay zombies. Only the
+   processes of known jobs are waited for, foreground waits keep their own children.
+   */
+void reapChildren(){
+	for(int i = 0; i < maxJobs; i++){
+		if(jobs[i].id == 0) continue;
+		for(int j = 0; j < jobs[i].pidCount; j++){
+			if(jobs[i].pids[j] <= 0 || waitpid(jobs[i].pids[j], NULL, WNOHANG) == 0) continue;
+			jobs[i].pids[j] = 0;
+			jobs[i].running--;
 		}
+		if(jobs[i].running > 0) continue;
+		if(!jobs[i].quiet) printf("[%d] Done\t%s\n", jobs[i].id, jobs[i].name);
+		jobs[i].id = 0;
 	}
+}
 
-	// TODO: Implement your custom commands here
-	if (strcmp(command->name, "filesearch") == 0){
-		int count = command->arg_count;
-		if(count > 0){
-			executeFilesearch(command, "./", command->args[count-1]);
-		}else{
-			printf("-%s: %s: Insufficient arguments\n", sysname, command->name);
+/*
+   Builtins that are not backgroundable change the state of the shell itself, like cd or every,
+   so a timer must never run them in the interactive shell. Every stage of the pipeline is
+   checked, as process_command does, and the error is printed here.
+   */
+int checkPeriodicCommand(struct command_t *command){
+	for(struct command_t *stage = command; stage != NULL; stage = stage->next){
+		const struct builtin_t *builtin = findBuiltin(stage->name);
+		if(builtin == NULL) continue;
+		if(!builtin->backgroundable){
+			printf("-%s: every: %s cannot run periodically\n", sysname, stage->name);
+			return -1;
+		}
+		if(command->next != NULL && !builtin->pipeable){
+			printf("-%s: every: %s: cannot be used in a pipeline\n", sysname, stage->name);
+			return -1;
 		}
-		return SUCCESS;
 	}
+	return 0;
+}
 
-	if(strcmp(command->name, "cdh") == 0) {
-		if(command->arg_count==0){ executeCdh(); }
-		else{ printf("-%s: %s: Insufficient arguments\n", sysname, command->name); }
-		return SUCCESS;
+/*
+   Runs every job whose timer expired. Commands run in the background,
+   so a slow job never delays the prompt or the other jobs. The due jobs are
+   collected first and looked up again by id, the table may change while they run.
+   */
+void runDueJobs(){
+	int due[maxEveryJobs], dueCount = 0;
+	for(int i = 0; i < everyJobCount; i++){
+		unsigned long long expirations;
+		if(read(everyJobs[i].timerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			due[dueCount++] = everyJobs[i].id;
 	}
 
-	if(strcmp(command->name, "take") == 0) {
-		if(command->arg_count==1) { executeTake(command); }
-		else{ printf("-%s: %s: Insufficient arguments\n", sysname, command->name); }
-		return SUCCESS;
+	for(int d = 0; d < dueCount; d++){
+		struct every_job_t *job = NULL;
+		for(int i = 0; i < everyJobCount && job == NULL; i++)
+			if(everyJobs[i].id == due[d]) job = &everyJobs[i];
+		if(job == NULL) continue;
+
+		job->runs++;
+		if(job->callback != NULL){
+			job->callback();
+			continue;
+		}
+		char line[maxCommandSize];
+		snprintf(line, sizeof(line), "%s", job->commandLine);
+		struct command_t *command = malloc(sizeof(struct command_t));
+		memset(command, 0, sizeof(struct command_t));
+		//expanded on every run, so $(...) and variables are evaluated each time
+		expandAndParse(line, command);
+		if(checkPeriodicCommand(command) != 0){
+			free_command(command);
+			continue;
+		}
+		command->background = true;
+		periodicLaunch = true;
+		process_command(command);
+		periodicLaunch = false;
+		free_command(command);
 	}
+	reapChildren();
+}
 
-	if(strcmp(command->name, "joker") == 0) {
-		if(command->arg_count==1 || command->arg_count==0) { executeJoker(command); }
-		else{ printf("-%s: %s: Insufficient arguments\n", sysname, command->name); }
-		return SUCCESS;
+/*
+   Fills pollfds with the timers of the periodic jobs after the first used entries.
+   */
+int addTimerPollFds(struct pollfd *fds, int used){
+	for(int i = 0; i < everyJobCount; i++){
+		fds[used].fd = everyJobs[i].timerFd;
+		fds[used].events = POLLIN;
+		used++;
 	}
-	if (strcmp(command->name, "pokemon") == 0){
-		if(command->arg_count > 0){
-			executePokemon(command);
-		}else{
-			printf("-%s: %s: Insufficient arguments\n", sysname, command->name);
+	return used;
+}
+
+/*
+   Reads one key from the terminal, running periodic jobs while waiting for it.
+   Returns EOF when stdin is closed.
+   */
+int readKey(){
+	unsigned char c;
+	struct pollfd fds[maxEveryJobs + 1];
+
+	fflush(stdout);
+	while(1){
+		if(everyJobCount > 0){
+			fds[0].fd = STDIN_FILENO;
+			fds[0].events = POLLIN;
+			int count = addTimerPollFds(fds, 1);
+			if(poll(fds, count, -1) < 0 && errno != EINTR) return EOF;
+			if(!(fds[0].revents & (POLLIN | POLLHUP))){
+				runDueJobs();
+				fflush(stdout);
+				continue;
+			}
 		}
-		return SUCCESS;
+		ssize_t len = read(STDIN_FILENO, &c, 1);
+		if(len == 1) return c;
+		if(len < 0 && errno == EINTR) continue;
+		return EOF;
 	}
+}
 
+int writeAll(int fd, const char *buffer, size_t len){
+	while(len > 0){
+		ssize_t written = write(fd, buffer, len);
+		if(written < 0 && errno == EINTR) continue;
+		if(written <= 0) return -1;
+		buffer += written;
+		len -= written;
+	}
+	return 0;
+}
 
-	if(strcmp(command->name, "rps") == 0) {
-		if(command->arg_count > 0) {
-			executeRps(command); 
-		}
-		else{ 
-			printf("-%s: %s: Insufficient arguments\n", sysname, command->name); 
+/*
+   Copies the captured output to stdout and the capture file until the pipeline closes it.
+   Periodic jobs keep running meanwhile, as in waitForChild.
+   */
+void drainCapture(){
+	char buffer[65536];
+	struct pollfd fds[maxEveryJobs + 1];
+	while(1){
+		fds[0].fd = captureReadFd;
+		fds[0].events = POLLIN;
+		int count = addTimerPollFds(fds, 1);
+		if(poll(fds, count, -1) < 0 && errno != EINTR) break;
+		if(!(fds[0].revents & (POLLIN | POLLHUP))){
+			runDueJobs();
+			fflush(stdout);
+			continue;
 		}
-		return SUCCESS;
+		ssize_t len = read(captureReadFd, buffer, sizeof(buffer));
+		if(len < 0 && errno == EINTR) continue;
+		if(len <= 0) break;
+		writeAll(STDOUT_FILENO, buffer, len);
+		if(!captureFailed && writeAll(captureFileFd, buffer, len) != 0) captureFailed = true;
+		captureLen += len;
 	}
+}
 
-	if(strcmp(command->name, "pstraverse") == 0) {
-		if(command->arg_count > 0) {
-			executePstraverse(command); 
-		}
-		else{ 
-			printf("-%s: %s: Insufficient arguments\n", sysname, command->name); 
+/*
+   Waits for a foreground child and returns its exit status. Periodic jobs keep running on time meanwhile,
+   by polling a pidfd of the child together with the job timers.
+   */
+int waitForChild(pid_t pid){
+	int pidFd = -1, status = 0;
+	unsigned long long waitStart = traceBegin();
+#ifdef SYS_pidfd_open
+	if(everyJobCount > 0) pidFd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+	if(pidFd >= 0){
+		struct pollfd fds[maxEveryJobs + 1];
+		while(1){
+			fds[0].fd = pidFd;
+			fds[0].events = POLLIN;
+			int count = addTimerPollFds(fds, 1);
+			if(poll(fds, count, -1) < 0 && errno != EINTR) break;
+			if(fds[0].revents & POLLIN) break;
+			runDueJobs();
+			fflush(stdout);
 		}
-		return SUCCESS;
+		close(pidFd);
 	}
+	while(waitpid(pid, &status, 0) < 0){
+		if(errno != EINTR) return -1;
+	}
+	traceEnd("wait", waitStart, NULL);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
 
+/*
+   every <interval> <command> runs a command periodically inside the shell, without cron.
+   every -l lists the jobs and every -r <id> removes one.
+   */
+void executeEvery(struct command_t *command){
+	if(strcmp(command->args[0], "-l") == 0){
+		for(int i = 0; i < everyJobCount; i++){
+			printf("%d\t", everyJobs[i].id);
+			printInterval(everyJobs[i].intervalNs);
+			printf("\t%lu runs\t%s\n", everyJobs[i].runs, everyJobs[i].commandLine ? everyJobs[i].commandLine : "(builtin)");
+		}
+		return;
+	}
+	if(strcmp(command->args[0], "-r") == 0){
+		if(command->arg_count < 2 || removeEveryJob(atoi(command->args[1])) != 0)
+			printf("-%s: %s: no such job\n", sysname, command->name);
+		if(command->arg_count > 1 && atoi(command->args[1]) == jokerJobId) jokerJobId = -1;
+		return;
+	}
 
-	pid_t pid = fork();
-
-	if (pid == 0) // child
-	{
-		// increase args size by 2
-		command->args = (char **)realloc(
-				command->args, sizeof(char *) * (command->arg_count += 2));
-
-		// shift everything forward by 1
-		for (int i = command->arg_count - 2; i > 0; --i)
-			command->args[i] = command->args[i - 1];
+	long long intervalNs;
+	if(command->arg_count < 2){
+		printf("-%s: %s: Insufficient arguments\n", sysname, command->name);
+		return;
+	}
+	if(parseInterval(command->args[0], &intervalNs) != 0){
+		printf("-%s: %s: invalid interval %s\n", sysname, command->name, command->args[0]);
+		return;
+	}
 
-		// set args[0] as a copy of name
-		command->args[0] = strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count - 1] = NULL;
+	char line[maxCommandSize];
+	line[0] = 0;
+	for(int i = 1; i < command->arg_count; i++){
+		if(strlen(line) + strlen(command->args[i]) + 2 > sizeof(line)) break;
+		if(i > 1) strcat(line, " ");
+		strcat(line, command->args[i]);
+	}
 
-		/// TODO: do your own exec with path resolving using execv()
+	//rejected up front rather than on every tick, aliases are applied but nothing is expanded yet
+	char parsed[maxCommandSize];
+	char *aliased = applyAliases(line);
+	snprintf(parsed, sizeof(parsed), "%s", aliased != NULL ? aliased : line);
+	free(aliased);
+	struct command_t *job = malloc(sizeof(struct command_t));
+	memset(job, 0, sizeof(struct command_t));
+	parse_command(parsed, job);
+	int rejected = checkPeriodicCommand(job);
+	free_command(job);
+	if(rejected != 0) return;
+	int id = addEveryJob(intervalNs, line, NULL);
+	if(id < 0){
+		printf("-%s: %s: cannot add more jobs\n", sysname, command->name);
+		return;
+	}
+	printf("[%d] every ", id);
+	printInterval(intervalNs);
+	printf(": %s\n", line);
+}
 
-		// Getting all the paths that may contain executable.
-		char *possibleCommandPaths = getenv("PATH");
-		// Creating a 2D array to store the paths
-		char commandPathArray[maxCommandSize][maxCommandSize];
-		// Creating a string tokenizer to parse through stored paths
-		char *token;
+/*
+   Sends a desktop notification with a joke. The joke is read from curl through a pipe
+   and handed to notify-send directly, no shell is involved.
+   */
+void tellJoke(){
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid != 0){//parent, the child is reaped with the other background jobs
+		if(pid > 0) addJob(&pid, 1, "joker", true);
+		return;
+	}
 
-		int pathCount = 0;
+	int fd[2];
+	char joke[maxCommandSize];
+	ssize_t len = 0, count;
+	if(pipe(fd) == -1) exit(1);
+	pid_t curlPid = fork();
+	if(curlPid == 0){
+		char *parameters[] = {"curl", "-s", "-H", "Accept: text/plain", "https://icanhazdadjoke.com/", NULL};
+		dup2(fd[WRITE_END], STDOUT_FILENO);
+		close(fd[READ_END]);
+		close(fd[WRITE_END]);
+		execvp(parameters[0], parameters);
+		exit(127);
+	}
+	close(fd[WRITE_END]);
+	while(len < (ssize_t)sizeof(joke) - 1 && (count = read(fd[READ_END], joke + len, sizeof(joke) - 1 - len)) > 0) len += count;
+	joke[len] = 0;
+	close(fd[READ_END]);
+	waitpid(curlPid, NULL, 0);
+	if(len == 0) exit(1);
 
-		token = strtok(possibleCommandPaths, ":");
-		//Placing the elements in possibleCommandPaths to 2D array
-		while (token != NULL ) {
-			strcpy(commandPathArray[pathCount], token);
-			token = strtok(NULL, ":");
-			pathCount++;
-		}
+	char *parameters[] = {"notify-send", "-i", "face-laugh", joke, NULL};
+	execvp(parameters[0], parameters);
+	exit(127);
+}
 
-		//Searching the paths for executable
-		for(int i = 0; i<pathCount; i++) {
-			strcat(commandPathArray[i], "/");
-			strcat(commandPathArray[i], command->name);
-			if (execv(commandPathArray[i], command->args) != -1) {
-				exit(0);
+/*
+  Tells a joke every 15 minutes using an every job, the user's crontab is never touched.
+  Disables joker given the -r option.
+  */
+void executeJoker(struct command_t *command){
+	if(command->arg_count == 1 && strcmp(command->args[0], "-r") == 0){
+		if(jokerJobId != -1) removeEveryJob(jokerJobId);
+		jokerJobId = -1;
+	}else if(command->arg_count == 0){
+		if(jokerJobId == -1) jokerJobId = addEveryJob(jokerIntervalNs, NULL, tellJoke);
+	}else{printf("Insufficient arguments\n");}
+}
+
+struct pokemon_t
+{
+	int number;
+	char name[maxPokeLength];
+};
+
+// pokedex is read once, then looked up by name through a hash table or directly by number
+static struct pokemon_t pokedex[maxPokemons];
+static int pokedexSize = 0, pokedexLoaded = 0;
+static short pokedexByName[pokedexBuckets];	// pokedex index + 1, 0 is an empty bucket
+static short pokedexByNumber[maxPokemons];	// pokedex index + 1 for each number
+
+unsigned int hashPokemonName(const char *name){
+	//case insensitive FNV-1a
+	unsigned int hash = 2166136261u;
+	for(; *name; name++){
+		hash ^= (unsigned char)tolower((unsigned char)*name);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+   Opens the pokemon list, from SHELLFYRE_POKEDEX if set, otherwise next to the
+   shellfyre executable, otherwise from the current directory.
+   */
+FILE *openPokedexFile(){
+	char path[PATH_MAX];
+	char *configured = getenv("SHELLFYRE_POKEDEX");
+	if(configured != NULL) return fopen(configured, "r");
+
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if(len > 0){
+		path[len] = 0;
+		char *slash = strrchr(path, '/');
+		if(slash != NULL && (slash - path) + strlen(pokedexFileName) + 2 < sizeof(path)){
+			strcpy(slash + 1, pokedexFileName);
+			FILE *fp = fopen(path, "r");
+			if(fp != NULL) return fp;
+		}
+	}
+	return fopen(pokedexFileName, "r");
+}
+
+int loadPokedex(){
+	char buffer[maxPokeLength];
+	if(pokedexLoaded) return 0;
+
+	FILE *fp = openPokedexFile();
+	if(fp == NULL){
+		printf("Error: could not open file %s\n", pokedexFileName);
+		return 1;
+	}
+
+	//lines look like "#025 Pikachu"
+	while(fgets(buffer, maxPokeLength, fp) && pokedexSize < maxPokemons){
+		int number;
+		char name[maxPokeLength];
+		buffer[strcspn(buffer, "\r\n")] = 0;
+		if(sscanf(buffer, "#%d %[^\n]", &number, name) != 2 || number <= 0 || number >= maxPokemons) continue;
+
+		struct pokemon_t *pokemon = &pokedex[pokedexSize];
+		pokemon->number = number;
+		strcpy(pokemon->name, name);
+
+		unsigned int bucket = hashPokemonName(name) & (pokedexBuckets - 1);
+		while(pokedexByName[bucket] != 0) bucket = (bucket + 1) & (pokedexBuckets - 1);
+		pokedexByName[bucket] = pokedexSize + 1;
+		pokedexByNumber[number] = pokedexSize + 1;
+		pokedexSize++;
+	}
+	fclose(fp);
+	pokedexLoaded = 1;
+	return 0;
+}
+
+/*
+   Finds a pokemon by its name (case insensitive) or its number, like "25" or "#025".
+   */
+struct pokemon_t *findPokemon(const char *searchedItem){
+	const char *digits = searchedItem[0] == '#' ? searchedItem + 1 : searchedItem;
+	if(*digits != 0 && strspn(digits, "0123456789") == strlen(digits)){
+		int number = atoi(digits);
+		if(number <= 0 || number >= maxPokemons || pokedexByNumber[number] == 0) return NULL;
+		return &pokedex[pokedexByNumber[number] - 1];
+	}
+
+	unsigned int bucket = hashPokemonName(searchedItem) & (pokedexBuckets - 1);
+	while(pokedexByName[bucket] != 0){
+		struct pokemon_t *pokemon = &pokedex[pokedexByName[bucket] - 1];
+		if(strcasecmp(pokemon->name, searchedItem) == 0) return pokemon;
+		bucket = (bucket + 1) & (pokedexBuckets - 1);
+	}
+	return NULL;
+}
+
+int editDistance(const char *first, const char *second){
+	int firstLen = strlen(first), secondLen = strlen(second);
+	int row[maxPokeLength + 1];
+	if(firstLen > maxPokeLength || secondLen > maxPokeLength) return maxPokeLength;
+
+	for(int j = 0; j <= secondLen; j++) row[j] = j;
+	for(int i = 1; i <= firstLen; i++){
+		int diagonal = row[0];
+		row[0] = i;
+		for(int j = 1; j <= secondLen; j++){
+			int above = row[j];
+			int cost = tolower((unsigned char)first[i - 1]) != tolower((unsigned char)second[j - 1]);
+			int best = diagonal + cost;
+			if(above + 1 < best) best = above + 1;
+			if(row[j - 1] + 1 < best) best = row[j - 1] + 1;
+			row[j] = best;
+			diagonal = above;
+		}
+	}
+	return row[secondLen];
+}
+
+/*
+   Prints up to maxPokeSuggestions names that are a few edits away from a misspelled name.
+   */
+void suggestPokemons(const char *searchedItem){
+	struct pokemon_t *suggestions[maxPokeSuggestions];
+	int distances[maxPokeSuggestions];
+	int count = 0;
+	int limit = strlen(searchedItem) / 3 + 1;
+
+	for(int i = 0; i < pokedexSize; i++){
+		int distance = editDistance(searchedItem, pokedex[i].name);
+		if(distance > limit) continue;
+		//keeping the closest names sorted by distance
+		int position = count < maxPokeSuggestions ? count++ : maxPokeSuggestions;
+		while(position > 0 && distances[position - 1] > distance){
+			if(position < maxPokeSuggestions){
+				suggestions[position] = suggestions[position - 1];
+				distances[position] = distances[position - 1];
+			}
+			position--;
+		}
+		if(position < maxPokeSuggestions){
+			suggestions[position] = &pokedex[i];
+			distances[position] = distance;
+		}
+	}
+
+	if(count == 0) return;
+	printf("Did you mean:");
+	for(int i = 0; i < count; i++) printf(" %s%s", suggestions[i]->name, i + 1 < count ? "," : "?\n");
+}
+
+/*
+   Creates a directory and all of its missing parents, like mkdir -p.
+   */
+int makeDirectories(const char *path){
+	char buffer[PATH_MAX];
+	if(strlen(path) >= sizeof(buffer)) return -1;
+	strcpy(buffer, path);
+	for(char *slash = strchr(buffer + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')){
+		*slash = 0;
+		if(mkdir(buffer, 0755) != 0 && errno != EEXIST) return -1;
+		*slash = '/';
+	}
+	if(mkdir(buffer, 0755) != 0 && errno != EEXIST) return -1;
+	return 0;
+}
+
+/*
+   Finds a cache directory: the one set in the variable configured, or shellfyre/<name>
+   under XDG_CACHE_HOME or ~/.cache. The directory is created when missing.
+   */
+int shellfyreCacheDir(const char *configured, const char *name, char *path, size_t size){
+	char *override = getenv(configured);
+	char *xdgCache = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+	int len;
+
+	if(override != NULL) len = snprintf(path, size, "%s", override);
+	else if(xdgCache != NULL) len = snprintf(path, size, "%s/shellfyre/%s", xdgCache, name);
+	else if(home != NULL) len = snprintf(path, size, "%s/.cache/shellfyre/%s", home, name);
+	else return -1;
+	if(len < 0 || (size_t)len >= size) return -1;
+	return makeDirectories(path);
+}
+
+// the art cache, SHELLFYRE_POKEMON_CACHE or shellfyre/pokemon under the cache directory
+int pokemonCacheDir(char *path, size_t size){
+	return shellfyreCacheDir("SHELLFYRE_POKEMON_CACHE", "pokemon", path, size);
+}
+
+/*
+   Minimal HTTP/1.0 GET, writes the response body to outFd. Only plain http is supported,
+   which is all the art server needs, and it avoids spawning a shell and curl per call.
+   */
+int fetchHttp(const char *url, int outFd){
+	char host[256], port[8] = "80", request[maxCommandSize];
+	const char *hostStart = url + strlen("http://");
+	const char *path = strchr(hostStart, '/');
+	size_t hostLen = path ? (size_t)(path - hostStart) : strlen(hostStart);
+	if(path == NULL) path = "/";
+	if(hostLen == 0 || hostLen >= sizeof(host)) return -1;
+	memcpy(host, hostStart, hostLen);
+	host[hostLen] = 0;
+	char *colon = strchr(host, ':');
+	if(colon != NULL){
+		*colon = 0;
+		snprintf(port, sizeof(port), "%s", colon + 1);
+	}
+
+	struct addrinfo hints, *addresses, *address;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, port, &hints, &addresses) != 0) return -1;
+
+	int sock = -1;
+	for(address = addresses; address != NULL; address = address->ai_next){
+		sock = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if(sock < 0) continue;
+		struct timeval timeout = {fetchTimeoutSeconds, 0};
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if(connect(sock, address->ai_addr, address->ai_addrlen) == 0) break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addresses);
+	if(sock < 0) return -1;
+
+	int len = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: close\r\n\r\n", path, host, sysname);
+	if(len < 0 || len >= (int)sizeof(request) || write(sock, request, len) != len){
+		close(sock);
+		return -1;
+	}
+
+	//the headers are buffered until the blank line, the body is streamed
+	char buffer[4096];
+	size_t used = 0;
+	bool inBody = false;
+	int result = -1;
+	ssize_t count;
+	while((count = read(sock, buffer + used, sizeof(buffer) - used)) > 0){
+		used += count;
+		if(inBody){
+			if(write(outFd, buffer, used) != (ssize_t)used) break;
+			used = 0;
+			continue;
+		}
+		char *end = memmem(buffer, used, "\r\n\r\n", 4);
+		if(end == NULL){
+			if(used == sizeof(buffer)) break;
+			continue;
+		}
+		if(strncmp(buffer, "HTTP/1.", 7) != 0 || used < 12 || strncmp(buffer + 8, " 200", 4) != 0) break;
+		inBody = true;
+		result = 0;
+		size_t headerLen = end + 4 - buffer;
+		if(write(outFd, end + 4, used - headerLen) != (ssize_t)(used - headerLen)) result = -1;
+		used = 0;
+		if(result != 0) break;
+	}
+	if(count < 0) result = -1;
+	close(sock);
+	return result;
+}
+
+int copyFileTo(const char *path, int outFd){
+	char buffer[4096];
+	ssize_t count;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	while((count = read(fd, buffer, sizeof(buffer))) > 0){
+		if(write(outFd, buffer, count) != count){
+			count = -1;
+			break;
+		}
+	}
+	close(fd);
+	return count < 0 ? -1 : 0;
+}
+
+/*
+   Downloads the art of a pokemon into the cache. The source is SHELLFYRE_POKEMON_URL,
+   either an http:// url or a file:// directory (for a local mirror), defaulting to fiikus.net
+   when it is unset or empty.
+   The art is written to a temporary file first, so concurrent fetches never see half a file.
+   */
+int fetchPokemonArt(int number, const char *cachePath){
+	char url[PATH_MAX], temporaryPath[PATH_MAX];
+	char *base = getenv("SHELLFYRE_POKEMON_URL");
+	if(base == NULL || base[0] == 0) base = pokemonArtUrl;
+
+	snprintf(url, sizeof(url), "%s%s%03d.txt", base, base[strlen(base) - 1] == '/' ? "" : "/", number);
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp", cachePath, getpid());
+	int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0) return -1;
+
+	int result;
+	if(strncmp(url, "http://", 7) == 0) result = fetchHttp(url, fd);
+	else if(strncmp(url, "file://", 7) == 0) result = copyFileTo(url + 7, fd);
+	else result = copyFileTo(url, fd);
+
+	close(fd);
+	if(result == 0 && rename(temporaryPath, cachePath) == 0) return 0;
+	unlink(temporaryPath);
+	return -1;
+}
+
+/*
+   Writes the cached art of a pokemon to stdout, fetching it on the first use.
+   */
+int showPokemonArt(int number){
+	char cachePath[PATH_MAX];
+	struct stat st;
+
+	if(pokemonCacheDir(cachePath, sizeof(cachePath) - 8) != 0){
+		printf("-%s: pokemon: cannot create the art cache\n", sysname);
+		return 1;
+	}
+	sprintf(cachePath + strlen(cachePath), "/%03d.txt", number);
+
+	int fd = open(cachePath, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){
+		if(fetchPokemonArt(number, cachePath) != 0 || (fd = open(cachePath, O_RDONLY | O_CLOEXEC)) < 0){
+			printf("-%s: pokemon: cannot fetch the art of #%03d\n", sysname, number);
+			return 1;
+		}
+	}
+
+	//the whole art goes out in a single write
+	if(fstat(fd, &st) == 0 && st.st_size > 0){
+		char *art = malloc(st.st_size);
+		ssize_t len = art ? read(fd, art, st.st_size) : -1;
+		fflush(stdout);
+		if(len > 0) write(STDOUT_FILENO, art, len);
+		free(art);
+	}
+	close(fd);
+	printf("\n");
+	return 0;
+}
+
+/*
+   Fills the art cache for every pokemon in the list using workers processes.
+   Each worker takes every workers-th pokemon, already cached ones are skipped.
+   */
+int prefetchPokemons(int workers){
+	char cacheDir[PATH_MAX];
+	if(pokemonCacheDir(cacheDir, sizeof(cacheDir) - 8) != 0){
+		printf("-%s: pokemon: cannot create the art cache\n", sysname);
+		return 1;
+	}
+	if(workers < 1) workers = 1;
+	if(workers > pokedexSize) workers = pokedexSize;
+
+	pid_t pids[workers];
+	fflush(stdout);
+	for(int worker = 0; worker < workers; worker++){
+		pid_t pid = pids[worker] = fork();
+		if(pid == 0){//child
+			int failed = 0;
+			char cachePath[PATH_MAX + 16];
+			for(int i = worker; i < pokedexSize; i += workers){
+				snprintf(cachePath, sizeof(cachePath), "%s/%03d.txt", cacheDir, pokedex[i].number);
+				if(access(cachePath, R_OK) == 0) continue;
+				if(fetchPokemonArt(pokedex[i].number, cachePath) != 0) failed++;
+			}
+			exit(failed > 255 ? 255 : failed);
+		}else if(pid < 0){
+			workers = worker;
+			break;
+		}
+	}
+
+	int failed = 0, status;
+	for(int worker = 0; worker < workers; worker++){
+		if(waitpid(pids[worker], &status, 0) > 0 && WIFEXITED(status)) failed += WEXITSTATUS(status);
+	}
+	printf("Prefetched %d pokemons into %s", pokedexSize - failed, cacheDir);
+	if(failed > 0) printf(", %d failed", failed);
+	printf("\n");
+	return failed > 0;
+}
+
+/* 
+   This command displays the pixel art of given pokemon, from the local art cache.
+   Only the pokemons in the txt file are drawable, they can be given by name or number.
+   pokemon --prefetch [-j workers] downloads the art of all of them.
+   */
+int executePokemon(struct command_t *command){
+
+	if(loadPokedex() != 0) return 1;
+
+	if(strcmp(command->args[0], "--prefetch") == 0){
+		int workers = defaultPrefetchWorkers;
+		if(command->arg_count > 2 && strcmp(command->args[1], "-j") == 0) workers = atoi(command->args[2]);
+		return prefetchPokemons(workers);
+	}
+
+	//names with spaces, like Mr. Mime, come in as several arguments
+	char searchedItem[maxPokeLength];
+	searchedItem[0] = 0;
+	for(int i = 0; i < command->arg_count; i++){
+		if(strlen(searchedItem) + strlen(command->args[i]) + 2 > maxPokeLength) break;
+		if(i > 0) strcat(searchedItem, " ");
+		strcat(searchedItem, command->args[i]);
+	}
+
+	struct pokemon_t *pokemon = findPokemon(searchedItem);
+	if(pokemon == NULL){
+		printf("Pokemon not found\n");
+		suggestPokemons(searchedItem);
+		return 0;
+	}
+
+	return showPokemonArt(pokemon->number);
+}
+
+/*
+   This command randomly picks rock paper scissors and plays with the user, then displays the # of wins, losses and ties.
+   Takes arguments "rock", "paper" or "scissors", case insensitive.
+   */
+void executeRps(struct command_t *command){
+	int random = rand() % 3;
+	printf("Here we go! 3\n");
+	sleep(1);
+	printf("2\n");
+	sleep(1);
+	printf("1...\n");
+	sleep(1);
+	if(random==0){
+		printf("SHOOT!\n"
+				"    _______\n"
+				"---'   ____)\n"
+				"      (_____)\n"
+				"      (_____)\n"
+				"      (____)\n"
+				"---.__(___)\n"
+				"\n");
+		if(strcasecmp("rock", command->args[0]) == 0){
+			printf("Rock? We tied.\n");
+			ties++; }
+		else if(strcasecmp("paper", command->args[0]) == 0){
+			printf("Paper? You win...\n");
+			victories++; }
+		else if(strcasecmp("scissors", command->args[0]) == 0){
+			printf("Scissors? Smashed you!\n");
+			defeats++; }
+		else{ printf("You gave an incorrect argument! Try rock, paper or scissors!\n"); }
+		printf("Times you won: %d\nTimes I won: %d\nTies: %d\n", victories, defeats, ties);
+	}
+	else if(random==1){
+		printf("SHOOT!\n"
+				"     _______\n"
+				"---'    ____)____\n"
+				"           ______)\n"
+				"          _______)\n"
+				"         _______)\n"
+				"---.__________)\n"
+				"\n");       
+		if(strcasecmp("rock", command->args[0]) == 0){
+			printf("Rock? I won!\n");
+			defeats++; }
+		else if(strcasecmp("paper", command->args[0]) == 0){
+			printf("Paper? Tied.\n");
+			ties++; }
+		else if(strcasecmp("scissors", command->args[0]) == 0){
+			printf("Scissors? Damn, you won.\n");
+			victories++; }
+		else{ printf("You gave an incorrect argument! Try rock, paper or scissors!\n"); }
+		printf("Times you won: %d\nTimes I won: %d\nTies: %d\n", victories, defeats, ties);
+	}
+	else if(random==2){
+		printf("SHOOT!\n"
+				"    _______	\n"
+				"---'   ____)____\n"
+				"          ______)\n"
+				"       __________)\n"
+				"      (____)\n"
+				"---.__(___)\n"
+				"\n");
+		if(strcasecmp("rock", command->args[0]) == 0){
+			printf("Rock? Dang, you won...\n");
+			victories++; }
+		else if(strcasecmp("paper", command->args[0]) == 0){
+			printf("Paper? Hah, sliced you!\n");
+			defeats++; }
+		else if(strcasecmp("scissors", command->args[0]) == 0){
+			printf("Scissors? Tied.\n");
+			ties++; }
+		else{ printf("You gave an incorrect argument! Try rock, paper or scissors!\n"); }
+		printf("Times you won: %d\nTimes I won: %d\nTies: %d\n", victories, defeats, ties);
+	}
+
+}
+
+/*
+   Runs a helper program and waits for it, returns its exit status.
+   */
+int runAndWait(char **parameters){
+	int status;
+	pid_t pid = fork();
+	if(pid == 0){//child
+		execv(parameters[0], parameters);
+		exit(127);
+	}else if(pid < 0){
+		return -1;
+	}
+	if(waitpid(pid, &status, 0) < 0) return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+   Opens the lock file shared by the sessions using the module. It lives in /run for root
+   and in XDG_RUNTIME_DIR otherwise, never in a directory other users can write to, and is
+   not followed if it is a symlink. Without a runtime directory there is no lock and the
+   module is simply left loaded on exit.
+   */
+int openModuleLock(){
+	char path[PATH_MAX];
+	const char *runtimeDir = geteuid() == 0 ? "/run" : getenv("XDG_RUNTIME_DIR");
+
+	if(runtimeDir == NULL || runtimeDir[0] != '/') return -1;
+	if(snprintf(path, sizeof(path), "%s/%s", runtimeDir, moduleLockName) >= (int)sizeof(path)) return -1;
+	return open(path, O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+}
+
+/*
+   Loads the kernel module unless it is already loaded, by this or any other session.
+   Every session using the module holds a shared lock on the module lock file, which is
+   how the last one to exit knows that it can unload the module.
+   */
+int loadModule(){
+	if(modInstalled == 1) return 0;
+
+	if(moduleLockFd == -1){
+		moduleLockFd = openModuleLock();
+		//blocks while an exiting session is unloading the module
+		if(moduleLockFd >= 0) flock(moduleLockFd, LOCK_SH);
+	}
+
+	if(access("/sys/module/" moduleName, F_OK) != 0){
+		if(geteuid() == 0){
+			//loading directly, no helper process is needed with privileges
+			int fd = open(modulePath, O_RDONLY | O_CLOEXEC);
+			if(fd < 0 || (syscall(SYS_finit_module, fd, "", 0) != 0 && errno != EEXIST)){
+				printf("-%s: pstraverse: cannot load %s: %s\n", sysname, modulePath, strerror(errno));
+				if(fd >= 0) close(fd);
+				return -1;
+			}
+			close(fd);
+		}else{
+			char *parameters[] = {"/usr/bin/sudo", "/usr/sbin/insmod", modulePath, NULL};
+			if(runAndWait(parameters) != 0 && access("/sys/module/" moduleName, F_OK) != 0){
+				printf("-%s: pstraverse: cannot load %s\n", sysname, modulePath);
+				return -1;
+			}
+		}
+	}
+
+	//udev creates the node asynchronously after the module is loaded
+	for(int i = 0; i < 100 && access(moduleDevice, F_OK) != 0; i++) usleep(10000);
+	//without the rule the node is only usable by root
+	if(geteuid() != 0 && access(moduleUdevRules, F_OK) != 0)
+		printf("-%s: pstraverse: %s is missing, run make install to let the shellfyre group use %s\n", sysname, moduleUdevRules, moduleDevice);
+	modInstalled = 1;
+	return 0;
+}
+
+/*
+   Unloads the kernel module if no other session holds the shared lock.
+   */
+void unloadModule(){
+	if(moduleLockFd == -1) return;
+
+	//an exclusive lock is only granted when this is the last session using the module
+	if(flock(moduleLockFd, LOCK_EX | LOCK_NB) == 0 && access("/sys/module/" moduleName, F_OK) == 0){
+		if(geteuid() == 0){
+			syscall(SYS_delete_module, moduleName, O_NONBLOCK);
+		}else{
+			char *parameters[] = {"/usr/bin/sudo", "/usr/sbin/rmmod", moduleName, NULL};
+			runAndWait(parameters);
+		}
+	}
+	close(moduleLockFd);
+	moduleLockFd = -1;
+	modInstalled = 0;
+}
+
+/*
+   Prints the totals of the subtree rooted at pid, summed by the module in a single traversal
+   that is depth first unless -b is given.
+   */
+void printPstraverseTotals(int fd, int pid, int depthFirst){
+	static const char stateNames[psStateCount] = {'R', 'S', 'D', 'T', 't', 'X', 'Z', 'P', 'I'};
+	struct ps_totals totals;
+	long pageSize = sysconf(_SC_PAGESIZE);
+
+	memset(&totals, 0, sizeof(totals));
+	totals.pid = pid;
+	totals.depthFirst = depthFirst;
+	if(ioctl(fd, AGGREGATE_VAL, &totals) == -1){
+		printf("Failed to execute ioctl, errno = %d %s\n", errno, strerror(errno));
+		return;
+	}
+	printf("Subtree of %d\n", totals.pid);
+	printf("\tProcesses: %u\n\tThreads: %u\n", totals.tasks, totals.threads);
+	printf("\tRSS: %llu kB\n", totals.rssPages * pageSize / 1024);
+	printf("\tUser time: %.3f s\n\tSystem time: %.3f s\n", totals.utimeNs / 1e9, totals.stimeNs / 1e9);
+	printf("\tStates:");
+	for(int i = 0; i < psStateCount; i++){
+		if(totals.states[i] > 0) printf(" %c=%u", stateNames[i], totals.states[i]);
+	}
+	printf("\n");
+	if(totals.dropped > 0) printf("\t(%u subtrees not counted)\n", totals.dropped);
+}
+
+void executePstraverse(struct command_t *command){
+
+	int check;
+	int fd;
+	char *end;
+
+	//the module is given a pid it can look up, never 0 for a word that is not a number
+	errno = 0;
+	long pid = strtol(command->args[0], &end, 10);
+	if(errno != 0 || end == command->args[0] || *end != '\0' || pid <= 0 || pid > INT_MAX){
+		printf("-%s: pstraverse: %s: invalid pid\n", sysname, command->args[0]);
+		lastStatus = 2;
+		return;
+	}
+	if(loadModule() != 0) return;
+	fd = open(moduleDevice, O_RDWR);
+	if(fd < 0){
+		printf("Failed to open device, errno = %d %s\n",errno,strerror(errno));
+		if(errno == EACCES) printf("-%s: pstraverse: %s is only usable by root and the shellfyre group\n", sysname, moduleDevice);
+		lastStatus = 1;
+		return;
+	}
+	//-a asks the module for subtree totals instead of the process list
+	if(command->arg_count > 1 && strcmp(command->args[1], "-a") == 0){
+		printPstraverseTotals(fd, (int)pid, command->arg_count < 3 || strcmp(command->args[2], "-b") != 0);
+		close(fd);
+		return;
+	}
+	//results are written by the module into a ring shared with this process
+	//the producer side is read only, only the page holding tail is writable
+	struct ps_ring *ring = mmap(NULL, ringSize, PROT_READ, MAP_SHARED, fd, 0);
+	struct ps_ring_consumer *consumer = mmap(NULL, sizeof(*consumer), PROT_READ | PROT_WRITE, MAP_SHARED, fd, ringConsumerOffset);
+	if(ring == MAP_FAILED || consumer == MAP_FAILED){
+		printf("Failed to map device, errno = %d %s\n", errno, strerror(errno));
+		if(ring != MAP_FAILED) munmap(ring, ringSize);
+		if(consumer != MAP_FAILED) munmap(consumer, sizeof(*consumer));
+		close(fd);
+		return;
+	}
+	//module reads pid and flag, flag may be missing
+	char *traverseArgs[2] = {command->args[0], command->arg_count > 1 ? command->args[1] : NULL};
+	char **traverseArgsPointer = traverseArgs;
+	check = ioctl(fd, WRITE_VAL, &traverseArgsPointer);
+	if (check == -1){
+		printf("Failed to execute ioctl, errno = %d %s\n", errno, strerror(errno));
+		munmap(ring, ringSize);
+		munmap(consumer, sizeof(*consumer));
+		close(fd);
+		return;
+	}
+
+	//consuming the records in place, head is only read once per batch
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = consumer->tail;
+	while(tail != head){
+		struct ps_record *record = &ring->records[tail % ring->capacity];
+		printf("PID: %d, Parent: %d, Procces name: %.*s\n", record->pid, record->ppid, psCommLen, record->comm);
+		tail++;
+	}
+	__atomic_store_n(&consumer->tail, tail, __ATOMIC_RELEASE);
+	if(ring->dropped > 0) printf("(%u processes not shown)\n", ring->dropped);
+
+	munmap(ring, ringSize);
+	munmap(consumer, sizeof(*consumer));
+	close(fd);
+}
+
+int builtinExit(struct command_t *command){
+	//if a kernel module is installed before, deletes it unless another session still uses it
+	if(modInstalled == 1) unloadModule();
+	return EXIT;
+}
+
+int builtinCd(struct command_t *command){
+	if(recDirOpened == 0) initializeFilePath();
+	int r = chdir(command->args[0]);
+	updateRecentDirectories();
+	if (r == -1)
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+	return SUCCESS;
+}
+
+// directory stack of pushd and popd, the top is the last entry
+static int dirStack[maxDirStack];
+static int dirStackSize = 0;
+
+/*
+   Prints where a directory handle points to now, read from /proc, so a renamed
+   directory shows its new path.
+   */
+void printDirectoryHandle(int fd){
+	char link[64], path[maxDirectoryPath];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	ssize_t len = readlink(link, path, sizeof(path) - 1);
+	if(len < 0) len = 0;
+	path[len] = 0;
+	printf(" %s", path);
+}
+
+int builtinDirs(struct command_t *command){
+	char *cwd = getcwd(NULL, 0);
+	printf("%s", cwd ? cwd : "?");
+	free(cwd);
+	for(int i = dirStackSize - 1; i >= 0; i--) printDirectoryHandle(dirStack[i]);
+	printf("\n");
+	return SUCCESS;
+}
+
+/*
+   pushd <directory> pushes a handle of the current directory and changes to the directory,
+   pushd alone swaps the current directory with the top of the stack. The handle is opened
+   before anything changes, so a failure leaves both the stack and the directory as they were.
+   */
+int builtinPushd(struct command_t *command){
+	if(command->arg_count == 0 && dirStackSize == 0){
+		printf("-%s: %s: no other directory\n", sysname, command->name);
+		lastStatus = 1;
+		return SUCCESS;
+	}
+	if(command->arg_count > 0 && dirStackSize == maxDirStack){
+		printf("-%s: %s: directory stack is full\n", sysname, command->name);
+		lastStatus = 1;
+		return SUCCESS;
+	}
+	if(recDirOpened == 0) initializeFilePath();
+	int current = openDirectoryHandle(".");
+	int r = current < 0 ? -1 : command->arg_count == 0 ? changeToHandle(dirStack[dirStackSize - 1]) : chdir(command->args[0]);
+	if(r == -1){
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+		if(current >= 0) close(current);
+		lastStatus = 1;
+		return SUCCESS;
+	}
+
+	if(command->arg_count == 0) close(dirStack[dirStackSize - 1]);
+	else dirStackSize++;
+	dirStack[dirStackSize - 1] = current;
+	updateRecentDirectories();
+	return builtinDirs(command);
+}
+
+/*
+   popd goes back to the directory on top of the stack with a single fchdir.
+   */
+int builtinPopd(struct command_t *command){
+	if(dirStackSize == 0){
+		printf("-%s: %s: directory stack empty\n", sysname, command->name);
+		lastStatus = 1;
+		return SUCCESS;
+	}
+	if(recDirOpened == 0) initializeFilePath();
+	//the entry is only popped once the directory was entered, like bash
+	int fd = dirStack[dirStackSize - 1];
+	if(changeToHandle(fd) == -1){
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+		lastStatus = 1;
+		return SUCCESS;
+	}
+	dirStackSize--;
+	close(fd);
+	updateRecentDirectories();
+	return builtinDirs(command);
+}
+
+int builtinFilesearch(struct command_t *command){
+	executeFilesearch(command, "./", command->args[command->arg_count - 1]);
+	return SUCCESS;
+}
+
+int builtinCdh(struct command_t *command){
+	executeCdh();
+	return SUCCESS;
+}
+
+int builtinTake(struct command_t *command){
+	executeTake(command);
+	return SUCCESS;
+}
+
+int builtinJoker(struct command_t *command){
+	executeJoker(command);
+	return SUCCESS;
+}
+
+int builtinEvery(struct command_t *command){
+	executeEvery(command);
+	return SUCCESS;
+}
+
+int builtinPokemon(struct command_t *command){
+	executePokemon(command);
+	return SUCCESS;
+}
+
+int builtinRps(struct command_t *command){
+	executeRps(command);
+	return SUCCESS;
+}
+
+int builtinPstraverse(struct command_t *command){
+	executePstraverse(command);
+	return SUCCESS;
+}
+
+int builtinBuiltins(struct command_t *command);
+int builtinLoad(struct command_t *command);
+int builtinJobs(struct command_t *command);
+int builtinParallel(struct command_t *command);
+int builtinTrace(struct command_t *command);
+int builtinUnload(struct command_t *command);
+int builtinExport(struct command_t *command);
+int builtinMemo(struct command_t *command);
+int builtinPin(struct command_t *command);
+int builtinAlias(struct command_t *command);
+int builtinUnalias(struct command_t *command);
+int builtinUnset(struct command_t *command);
+
+static const struct builtin_t defaultBuiltins[] = {
+	// name, min args, max args, pipeable, backgroundable, handler, usage
+	{"exit", 0, 0, false, false, builtinExit, "exit the shell"},
+	{"cd", 1, 1, false, false, builtinCd, "cd <directory>"},
+	{"filesearch", 1, -1, true, true, builtinFilesearch, "filesearch [-r] [-o] <text>"},
+	{"cdh", 0, 0, false, false, builtinCdh, "pick a recently visited directory"},
+	{"pushd", 0, 1, false, false, builtinPushd, "pushd [directory], swap with the top when no directory is given"},
+	{"popd", 0, 0, false, false, builtinPopd, "popd, go back to the directory on top of the stack"},
+	{"dirs", 0, 0, true, true, builtinDirs, "list the directory stack"},
+	{"take", 1, -1, false, false, builtinTake, "take <path...>, create directories and enter a single one"},
+	{"joker", 0, 1, false, false, builtinJoker, "joker [-r], a joke every 15 minutes"},
+	{"every", 1, -1, false, false, builtinEvery, "every <interval> <command> | -l | -r <id>"},
+	{"pokemon", 1, -1, true, true, builtinPokemon, "pokemon <name or number> | --prefetch [-j n]"},
+	{"rps", 1, -1, true, true, builtinRps, "rps <rock|paper|scissors>"},
+	{"pstraverse", 1, -1, true, true, builtinPstraverse, "pstraverse <pid> <-d|-b|-a [-d|-b]>"},
+	{"builtins", 0, 0, true, true, builtinBuiltins, "list the builtin commands"},
+	{"jobs", 0, 0, true, false, builtinJobs, "list the background jobs"},
+	{"parallel", 1, -1, true, true, builtinParallel, "parallel [-j n] [-k] <command> [::: inputs]"},
+	{"memo", 1, -1, true, true, builtinMemo, "memo [-e NAME]... [-i file]... <command...>"},
+	{"pin", 0, -1, true, true, builtinPin, "pin [-c cpus] [-n nice] [-i class[:level]] [-m [mode:]nodes] [--spread on|off] [command...]"},
+	{"sched", 0, -1, true, true, builtinPin, "same as pin"},
+	{"trace", 1, 2, false, false, builtinTrace, "trace on [file] | trace off"},
+	{"load", 1, 2, false, false, builtinLoad, "load [-isolate] <plugin.so>"},
+	{"unload", 1, 1, false, false, builtinUnload, "unload <plugin.so or builtin>"},
+	{"alias", 0, -1, true, true, builtinAlias, "alias [name=value]..."},
+	{"unalias", 1, -1, false, false, builtinUnalias, "unalias <name...>"},
+	{"export", 0, -1, false, false, builtinExport, "export [NAME[=value]...]"},
+	{"unset", 1, -1, false, false, builtinUnset, "unset <NAME...>"},
+};
+
+// open addressing table of registered builtins, sized well above the number of builtins
+static const struct builtin_t *builtinTable[builtinBuckets];
+static int builtinCount = 0;
+
+unsigned int hashBuiltinName(const char *name){
+	//FNV-1a
+	unsigned int hash = 2166136261u;
+	for(; *name; name++){
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+const struct builtin_t *findBuiltin(const char *name){
+	unsigned int bucket = hashBuiltinName(name) & (builtinBuckets - 1);
+	while(builtinTable[bucket] != NULL){
+		if(strcmp(builtinTable[bucket]->name, name) == 0) return builtinTable[bucket];
+		bucket = (bucket + 1) & (builtinBuckets - 1);
+	}
+	return NULL;
+}
+
+/*
+   Adds a builtin to the registry. The descriptor is not copied, it has to outlive the registration.
+   Returns -1 when a builtin with the same name exists or the table is full.
+   */
+int registerBuiltin(const struct builtin_t *builtin){
+	if(builtinCount >= builtinBuckets / 2 || findBuiltin(builtin->name) != NULL) return -1;
+	unsigned int bucket = hashBuiltinName(builtin->name) & (builtinBuckets - 1);
+	while(builtinTable[bucket] != NULL) bucket = (bucket + 1) & (builtinBuckets - 1);
+	builtinTable[bucket] = builtin;
+	builtinCount++;
+	return 0;
+}
+
+/*
+   Removes a builtin from the registry. The entries after it in the same cluster
+   are inserted again, so lookups never stop early at the freed bucket.
+   */
+int unregisterBuiltin(const char *name){
+	unsigned int bucket = hashBuiltinName(name) & (builtinBuckets - 1);
+	while(builtinTable[bucket] != NULL && strcmp(builtinTable[bucket]->name, name) != 0)
+		bucket = (bucket + 1) & (builtinBuckets - 1);
+	if(builtinTable[bucket] == NULL) return -1;
+
+	builtinTable[bucket] = NULL;
+	builtinCount--;
+	for(bucket = (bucket + 1) & (builtinBuckets - 1); builtinTable[bucket] != NULL; bucket = (bucket + 1) & (builtinBuckets - 1)){
+		const struct builtin_t *moved = builtinTable[bucket];
+		builtinTable[bucket] = NULL;
+		builtinCount--;
+		registerBuiltin(moved);
+	}
+	return 0;
+}
+
+void registerDefaultBuiltins(){
+	for(size_t i = 0; i < sizeof(defaultBuiltins) / sizeof(defaultBuiltins[0]); i++)
+		registerBuiltin(&defaultBuiltins[i]);
+}
+
+static struct plugin_t *plugins[maxPlugins];
+static int pluginCount = 0;
+
+/*
+   Runs a builtin of a loaded plugin inside the shell, or in a forked child
+   when the plugin was loaded with -isolate.
+   */
+int builtinPlugin(struct command_t *command){
+	const struct builtin_t *builtin = findBuiltin(command->name);
+	char *argv[command->arg_count + 2];
+
+	argv[0] = command->name;
+	for(int i = 0; i < command->arg_count; i++) argv[i + 1] = command->args[i];
+	argv[command->arg_count + 1] = NULL;
+
+	if(!builtin->isolate){
+		builtin->external->run(command->arg_count + 1, argv);
+		fflush(stdout);
+		return SUCCESS;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0){//child
+		int status = builtin->external->run(command->arg_count + 1, argv);
+		fflush(stdout);
+		_exit(status);
+	}else if(pid > 0){
+		waitForChild(pid);
+	}
+	return SUCCESS;
+}
+
+int registerPluginBuiltin(struct shellfyre_host *host, const struct shellfyre_builtin *external){
+	struct plugin_t *plugin = host->context;
+	if(plugin->builtinCount == maxPluginBuiltins || external->name == NULL || external->run == NULL) return -1;
+
+	struct builtin_t *builtin = &plugin->builtins[plugin->builtinCount];
+	builtin->name = external->name;
+	builtin->minArgs = external->min_args;
+	builtin->maxArgs = external->max_args;
+	builtin->pipeable = true;
+	builtin->backgroundable = true;
+	builtin->handler = builtinPlugin;
+	builtin->help = external->help;
+	builtin->external = external;
+	builtin->isolate = plugin->isolate;
+	if(registerBuiltin(builtin) != 0){
+		printf("-%s: load: %s is already a builtin\n", sysname, external->name);
+		return -1;
+	}
+	plugin->builtinCount++;
+	return 0;
+}
+
+void freePlugin(struct plugin_t *plugin){
+	for(int i = 0; i < plugin->builtinCount; i++) unregisterBuiltin(plugin->builtins[i].name);
+	if(plugin->handle) dlclose(plugin->handle);
+	free(plugin->path);
+	free(plugin);
+}
+
+/*
+   load [-isolate] <path.so> adds the builtins of a plugin, see shellfyre_plugin.h.
+   */
+int builtinLoad(struct command_t *command){
+	bool isolate = strcmp(command->args[0], "-isolate") == 0;
+	if(isolate && command->arg_count < 2){
+		printf("-%s: %s: Insufficient arguments\n", sysname, command->name);
+		return SUCCESS;
+	}
+	const char *path = command->args[isolate ? 1 : 0];
+	if(pluginCount == maxPlugins){
+		printf("-%s: %s: too many plugins\n", sysname, command->name);
+		return SUCCESS;
+	}
+
+	struct plugin_t *plugin = calloc(1, sizeof(struct plugin_t));
+	plugin->path = strdup(path);
+	plugin->isolate = isolate;
+	plugin->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if(plugin->handle == NULL){
+		printf("-%s: %s: %s\n", sysname, command->name, dlerror());
+		freePlugin(plugin);
+		return SUCCESS;
+	}
+
+	const int *abi = dlsym(plugin->handle, "shellfyre_plugin_abi");
+	shellfyre_plugin_init_t init = (shellfyre_plugin_init_t)dlsym(plugin->handle, "shellfyre_plugin_init");
+	if(abi == NULL || *abi != SHELLFYRE_PLUGIN_ABI || init == NULL){
+		printf("-%s: %s: %s is not a plugin for ABI version %d\n", sysname, command->name, path, SHELLFYRE_PLUGIN_ABI);
+		freePlugin(plugin);
+		return SUCCESS;
+	}
+
+	struct shellfyre_host host = {SHELLFYRE_PLUGIN_ABI, registerPluginBuiltin, plugin};
+	if(init(&host) != 0){
+		printf("-%s: %s: %s failed to initialize\n", sysname, command->name, path);
+		freePlugin(plugin);
+		return SUCCESS;
+	}
+	plugins[pluginCount++] = plugin;
+	return SUCCESS;
+}
+
+/*
+   unload <path.so or builtin name> removes a plugin and all the builtins it added.
+   */
+int builtinUnload(struct command_t *command){
+	for(int i = 0; i < pluginCount; i++){
+		struct plugin_t *plugin = plugins[i];
+		bool matches = strcmp(plugin->path, command->args[0]) == 0;
+		for(int j = 0; j < plugin->builtinCount && !matches; j++)
+			matches = strcmp(plugin->builtins[j].name, command->args[0]) == 0;
+		if(!matches) continue;
+
+		shellfyre_plugin_fini_t fini = (shellfyre_plugin_fini_t)dlsym(plugin->handle, "shellfyre_plugin_fini");
+		if(fini != NULL) fini();
+		freePlugin(plugin);
+		plugins[i] = plugins[--pluginCount];
+		return SUCCESS;
+	}
+	printf("-%s: %s: %s is not loaded\n", sysname, command->name, command->args[0]);
+	return SUCCESS;
+}
+
+void addBuiltinCompletions(const char *prefix, struct glob_results_t *results){
+	size_t prefixLen = strlen(prefix);
+	for(int i = 0; i < builtinBuckets; i++)
+		if(builtinTable[i] != NULL && strncmp(builtinTable[i]->name, prefix, prefixLen) == 0)
+			addGlobResult(results, "", 0, builtinTable[i]->name);
+}
+
+int compareBuiltins(const void *first, const void *second){
+	return strcmp((*(const struct builtin_t **)first)->name, (*(const struct builtin_t **)second)->name);
+}
+
+/*
+   Lists the registered builtins sorted by name, with the flags they were registered with.
+   */
+int builtinBuiltins(struct command_t *command){
+	const struct builtin_t *sorted[builtinBuckets];
+	int count = 0;
+	for(int i = 0; i < builtinBuckets; i++)
+		if(builtinTable[i] != NULL) sorted[count++] = builtinTable[i];
+	qsort(sorted, count, sizeof(sorted[0]), compareBuiltins);
+
+	for(int i = 0; i < count; i++){
+		printf("%-12s %s%s  %s\n", sorted[i]->name,
+				sorted[i]->pipeable ? "p" : "-", sorted[i]->backgroundable ? "&" : "-",
+				sorted[i]->help ? sorted[i]->help : "");
+	}
+	return SUCCESS;
+}
+
+/*
+   Writes a pipeline back as text, for the job list.
+   */
+void formatCommand(struct command_t *command, char *buf, size_t size){
+	size_t used = 0;
+	buf[0] = 0;
+	for(; command != NULL && used < size; command = command->next){
+		used += snprintf(buf + used, size - used, "%s%s", used ? " | " : "", command->name);
+		for(int i = 0; i < command->arg_count && used < size; i++)
+			used += snprintf(buf + used, size - used, " %s", command->args[i]);
+	}
+}
+
+/*
+   Applies < > and >> redirections of a command, called in the child before it runs.
+   */
+void setupRedirects(struct command_t *command){
+	static const int flags[3] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND};
+	if(!command->redirects[0] && !command->redirects[1] && !command->redirects[2]) return;
+	unsigned long long redirectStart = traceBegin();
+	for(int i = 0; i < 3; i++){
+		if(!command->redirects[i]) continue;
+		int fd = open(command->redirects[i], flags[i], 0644);
+		if(fd < 0){
+			fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			exit(1);
+		}
+		dup2(fd, i == 0 ? STDIN_FILENO : STDOUT_FILENO);
+		close(fd);
+	}
+	traceEnd("redirects", redirectStart, NULL);
+}
+
+// where commands were found in PATH, resolved in the shell so forked children look up nothing
+struct command_path_t
+{
+	char *name;					// NULL for an empty bucket
+	char *path;
+};
+
+static struct command_path_t commandPaths[commandPathBuckets];
+static int commandPathCount = 0;
+static char *commandPathsFor = NULL;	// the PATH the table was filled for
+
+void addCommandPath(const char *name, const char *path){
+	if(commandPathCount >= commandPathBuckets / 2) return;
+	unsigned int bucket = hashBuiltinName(name) & (commandPathBuckets - 1);
+	while(commandPaths[bucket].name != NULL){
+		if(strcmp(commandPaths[bucket].name, name) == 0) return;
+		bucket = (bucket + 1) & (commandPathBuckets - 1);
+	}
+	commandPaths[bucket].name = strdup(name);
+	commandPaths[bucket].path = strdup(path);
+	commandPathCount++;
+}
+
+/*
+   Empties the table when PATH changed since it was filled, returns the current PATH.
+   */
+const char *checkCommandPaths(){
+	const char *path = getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin";
+	if(commandPathsFor != NULL && strcmp(commandPathsFor, path) == 0) return path;
+	for(int i = 0; i < commandPathBuckets; i++){
+		free(commandPaths[i].name);
+		free(commandPaths[i].path);
+		commandPaths[i].name = commandPaths[i].path = NULL;
+	}
+	commandPathCount = 0;
+	free(commandPathsFor);
+	commandPathsFor = strdup(path);
+	return path;
+}
+
+/*
+   Finds the full path of a command through the table, searching PATH on a miss.
+   Returns NULL when it is not found or the name is a path already.
+   */
+const char *resolveCommand(const char *name){
+	char candidate[PATH_MAX];
+	if(strchr(name, '/') != NULL || name[0] == 0) return NULL;
+	const char *path = checkCommandPaths();
+
+	unsigned int bucket = hashBuiltinName(name) & (commandPathBuckets - 1);
+	for(; commandPaths[bucket].name != NULL; bucket = (bucket + 1) & (commandPathBuckets - 1))
+		if(strcmp(commandPaths[bucket].name, name) == 0) return commandPaths[bucket].path;
+
+	for(const char *directory = path; *directory; ){
+		size_t len = strcspn(directory, ":");
+		if(len > 0 && snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, directory, name) < (int)sizeof(candidate) &&
+				access(candidate, X_OK) == 0){
+			addCommandPath(name, candidate);
+			return resolveCommand(name);
+		}
+		directory += len;
+		if(*directory == ':') directory++;
+	}
+	return NULL;
+}
+
+/*
+   Fills the table with every executable of PATH, for the server before it takes requests.
+   */
+void warmCommandPaths(){
+	char candidate[PATH_MAX];
+	const char *path = checkCommandPaths();
+	for(const char *directory = path; *directory; ){
+		size_t len = strcspn(directory, ":");
+		snprintf(candidate, sizeof(candidate), "%.*s", (int)len, directory);
+		DIR *dir = len > 0 ? opendir(candidate) : NULL;
+		struct dirent *entry;
+		while(dir != NULL && (entry = readdir(dir)) != NULL){
+			if(entry->d_name[0] == '.' || faccessat(dirfd(dir), entry->d_name, X_OK, 0) != 0) continue;
+			struct stat st;
+			if(fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+			snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, directory, entry->d_name);
+			addCommandPath(entry->d_name, candidate);
+		}
+		if(dir != NULL) closedir(dir);
+		directory += len;
+		if(*directory == ':') directory++;
+	}
+}
+
+/*
+   Executes an external command in the current (child) process, never returns.
+   */
+void execCommand(struct command_t *command)
+{
+	// increase args size by 2
+	command->args = (char **)realloc(
+			command->args, sizeof(char *) * (command->arg_count += 2));
+
+	// shift everything forward by 1
+	for (int i = command->arg_count - 2; i > 0; --i)
+		command->args[i] = command->args[i - 1];
+
+	// set args[0] as a copy of name
+	command->args[0] = strdup(command->name);
+	// set args[arg_count-1] (last) to NULL
+	command->args[command->arg_count - 1] = NULL;
+
+	// paths like ./script or /bin/true are not searched in PATH
+	if (strchr(command->name, '/') != NULL)
+	{
+		traceInstant("exec", command->name);
+		execv(command->name, command->args);
+		fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+		exit(127);
+	}
+
+	//the span covers the table lookup and every PATH directory probed, it ends at the last
+	//execv tried and names its path, which is the one that succeeded when the command is found
+	struct trace_event_t *resolveSpan = traceOpen("path_resolution", command->name);
+
+	//the shell resolved the name before forking, a stale entry falls back to the search below
+	const char *resolved = resolveCommand(command->name);
+	if (resolved != NULL)
+	{
+		traceExtend(resolveSpan, resolved);
+		traceInstant("exec", resolved);
+		execv(resolved, command->args);
+	}
+
+	// Getting all the paths that may contain executable, copied so strtok leaves the environment intact
+	char *possibleCommandPaths = strdup(getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin");
+	// Creating a 2D array to store the paths
+	char commandPathArray[maxCommandSize][maxCommandSize];
+	// Creating a string tokenizer to parse through stored paths
+	char *token;
+
+	int pathCount = 0;
+
+	token = strtok(possibleCommandPaths, ":");
+	//Placing the elements in possibleCommandPaths to 2D array
+	while (token != NULL ) {
+		strcpy(commandPathArray[pathCount], token);
+		token = strtok(NULL, ":");
+		pathCount++;
+	}
+
+	//Searching the paths for executable
+	for(int i = 0; i<pathCount; i++) {
+		strcat(commandPathArray[i], "/");
+		strcat(commandPathArray[i], command->name);
+		traceExtend(resolveSpan, commandPathArray[i]);
+		execv(commandPathArray[i], command->args);
+	}
+	traceExtend(resolveSpan, command->name);
+
+	// If an executable isn't found, prints error message
+	fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+	exit(127);
+}
+
+/*
+   Runs one stage of a pipeline in a forked child, a builtin or an external command.
+   */
+void runInChild(struct command_t *command, const struct builtin_t *builtin)
+{
+	setupRedirects(command);
+	if (builtin == NULL)
+		execCommand(command);
+
+	if (command->arg_count < builtin->minArgs)
+		fprintf(stderr, "-%s: %s: Insufficient arguments\n", sysname, command->name);
+	else if (builtin->maxArgs >= 0 && command->arg_count > builtin->maxArgs)
+		fprintf(stderr, "-%s: %s: Too many arguments\n", sysname, command->name);
+	else
+	{
+		unsigned long long builtinStart = traceBegin();
+		lastStatus = 0;
+		builtin->handler(command);
+		traceEnd("builtin", builtinStart, command->name);
+		exit(lastStatus);
+	}
+	exit(2);
+}
+
+/*
+   Placement of launched commands: CPU affinity, nice, I/O priority and NUMA memory policy,
+   applied in each forked child before it runs the command.
+   */
+struct placement_t
+{
+	bool active;
+	bool hasCpus;
+	cpu_set_t cpus;
+	bool hasNice;
+	int nice;
+	bool hasIoprio;
+	int ioprio;					// class and level encoded for ioprio_set
+	bool hasMemPolicy;
+	int memPolicyMode;
+	unsigned long nodeMask;
+	int spread;					// --spread on (1) or off (0), -1 when not given
+};
+
+// placement of the pipeline being launched, set by pin or sched in front of it
+static struct placement_t launchPlacement;
+// session default: & jobs get the next allowed core, round-robin
+static bool spreadBackground = false;
+static unsigned int nextSpreadCpu = 0;
+
+/*
+   Parses a list like 0-3,8,10-11 and calls add for every number, returns -1 when malformed.
+   */
+int parseNumberList(const char *text, int limit, void (*add)(int number, void *target), void *target){
+	char *end;
+	if(*text == 0) return -1;
+	while(*text){
+		long first = strtol(text, &end, 10), last = first;
+		if(end == text) return -1;
+		if(*end == '-'){
+			text = end + 1;
+			last = strtol(text, &end, 10);
+			if(end == text) return -1;
+		}
+		if(first < 0 || last < first || last >= limit) return -1;
+		for(long number = first; number <= last; number++) add(number, target);
+		if(*end != ',' && *end != 0) return -1;
+		text = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+void addCpu(int number, void *target){
+	CPU_SET(number, (cpu_set_t *)target);
+}
+
+void addNode(int number, void *target){
+	*(unsigned long *)target |= 1UL << number;
+}
+
+/*
+   Reads the options of pin and sched into placement. Returns the index of the first word
+   of the command, or -1 after printing what is wrong.
+   */
+int parsePlacement(struct command_t *command, struct placement_t *placement){
+	static const char *ioClasses[] = {"", "rt", "be", "idle"};
+	static const char *memModes[] = {"default", "preferred", "bind", "interleave"};
+	int first = 0;
+	memset(placement, 0, sizeof(*placement));
+	placement->spread = -1;
+
+	while(first < command->arg_count && command->args[first][0] == '-'){
+		char *option = command->args[first];
+		if(strcmp(option, "--") == 0){
+			first++;
+			break;
+		}
+		if(first + 1 == command->arg_count){
+			printf("-%s: %s: %s needs a value\n", sysname, command->name, option);
+			return -1;
+		}
+		char *value = command->args[first + 1], *end;
+		bool valid = true;
+
+		if(strcmp(option, "-c") == 0){
+			CPU_ZERO(&placement->cpus);
+			valid = parseNumberList(value, CPU_SETSIZE, addCpu, &placement->cpus) == 0;
+			placement->hasCpus = true;
+		}else if(strcmp(option, "-n") == 0){
+			placement->nice = strtol(value, &end, 10);
+			valid = end != value && *end == 0 && placement->nice >= -20 && placement->nice <= 19;
+			placement->hasNice = true;
+		}else if(strcmp(option, "-i") == 0){
+			//class[:level], level 0 is the highest priority of the class
+			size_t len = strcspn(value, ":");
+			int ioClass = 0, level = value[len] == ':' ? strtol(value + len + 1, &end, 10) : 4;
+			for(int i = 1; i < 4; i++)
+				if(strlen(ioClasses[i]) == len && strncmp(value, ioClasses[i], len) == 0) ioClass = i;
+			valid = ioClass != 0 && level >= 0 && level <= 7 && (value[len] != ':' || *end == 0);
+			placement->ioprio = (ioClass << ioprioClassShift) | (ioClass == 3 ? 0 : level);
+			placement->hasIoprio = true;
+		}else if(strcmp(option, "-m") == 0){
+			//[mode:]nodes, the mode is bind when it is left out
+			char *colon = strchr(value, ':');
+			placement->memPolicyMode = 2;
+			if(colon != NULL){
+				placement->memPolicyMode = 0;
+				for(int i = 1; i < 4; i++)
+					if(strlen(memModes[i]) == (size_t)(colon - value) && strncmp(value, memModes[i], colon - value) == 0)
+						placement->memPolicyMode = i;
+			}
+			placement->nodeMask = 0;
+			valid = placement->memPolicyMode != 0 &&
+				parseNumberList(colon ? colon + 1 : value, sizeof(unsigned long) * 8, addNode, &placement->nodeMask) == 0;
+			placement->hasMemPolicy = true;
+		}else if(strcmp(option, "--spread") == 0){
+			valid = strcmp(value, "on") == 0 || strcmp(value, "off") == 0;
+			placement->spread = strcmp(value, "on") == 0;
+		}else{
+			printf("-%s: %s: unknown option %s\n", sysname, command->name, option);
+			return -1;
+		}
+
+		if(!valid){
+			printf("-%s: %s: invalid value %s for %s\n", sysname, command->name, value, option);
+			return -1;
+		}
+		first += 2;
+	}
+	placement->active = placement->hasCpus || placement->hasNice || placement->hasIoprio || placement->hasMemPolicy;
+	return first;
+}
+
+/*
+   Applies a placement to the calling process, a forked child that is about to run its command.
+   A placement that cannot be applied stops the child, rather than running the command unplaced.
+   */
+void applyPlacement(const struct placement_t *placement){
+	const char *failed = NULL;
+	if(placement->hasCpus && sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) != 0) failed = "affinity";
+	else if(placement->hasNice && setpriority(PRIO_PROCESS, 0, placement->nice) != 0) failed = "nice";
+	else if(placement->hasIoprio && syscall(SYS_ioprio_set, ioprioWhoProcess, 0, placement->ioprio) != 0) failed = "ioprio";
+	else if(placement->hasMemPolicy && syscall(SYS_set_mempolicy, placement->memPolicyMode, &placement->nodeMask, sizeof(unsigned long) * 8) != 0) failed = "memory policy";
+	if(failed != NULL){
+		fprintf(stderr, "-%s: %s: %s\n", sysname, failed, strerror(errno));
+		exit(126);
+	}
+}
+
+/*
+   Places a background job on the next core the shell may run on. Memory then comes from the
+   node of that core, since the default policy allocates locally.
+   */
+void spreadPlacement(struct placement_t *placement){
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) return;
+	int index = nextSpreadCpu++ % CPU_COUNT(&allowed);
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		if(!CPU_ISSET(cpu, &allowed) || index-- > 0) continue;
+		CPU_ZERO(&placement->cpus);
+		CPU_SET(cpu, &placement->cpus);
+		placement->hasCpus = placement->active = true;
+		return;
+	}
+}
+
+/*
+   pin and sched [-c cpus] [-n nice] [-i class[:level]] [-m [mode:]nodes] <command...>
+   place a command. In front of a pipeline they place all of its stages, process_command
+   takes care of that; here a single stage places itself. --spread on|off sets the session
+   default for & jobs.
+   */
+int builtinPin(struct command_t *command){
+	struct placement_t placement;
+	int first = parsePlacement(command, &placement);
+	if(first < 0){
+		lastStatus = 2;
+		return SUCCESS;
+	}
+	if(placement.spread != -1) spreadBackground = placement.spread;
+	if(first == command->arg_count){
+		if(placement.spread == -1) printf("spread of background jobs is %s\n", spreadBackground ? "on" : "off");
+		return SUCCESS;
+	}
+
+	//running as a stage of a pipeline, in its own child
+	struct command_t *placed = calloc(1, sizeof(struct command_t));
+	placed->name = strdup(command->args[first]);
+	placed->args = malloc(sizeof(char *) * (command->arg_count - first));
+	for(int i = first + 1; i < command->arg_count; i++) placed->args[placed->arg_count++] = strdup(command->args[i]);
+	fflush(stdout);
+	applyPlacement(&placement);
+	runInChild(placed, findBuiltin(placed->name));
+	return SUCCESS;
+}
+
+/*
+   Takes the options of a pin or sched prefix off the command, so the command that follows
+   is the first stage of the pipeline. Returns 1 when no command follows, -1 on bad options.
+   */
+int stripPlacementPrefix(struct command_t *command, struct placement_t *placement){
+	int first = parsePlacement(command, placement);
+	if(first < 0) return -1;
+	if(first == command->arg_count) return 1;
+	if(placement->spread != -1) spreadBackground = placement->spread;
+
+	free(command->name);
+	for(int i = 0; i < first; i++) free(command->args[i]);
+	command->name = command->args[first];
+	command->arg_count -= first + 1;
+	memmove(command->args, command->args + first + 1, sizeof(char *) * command->arg_count);
+	return 0;
+}
+
+/*
+   Forks every stage of a pipeline connected with pipes. Foreground pipelines are waited
+   for, background ones are added to the job table. Builtins run in the forked children too,
+   so they can be piped, redirected and put in the background like external commands.
+   */
+int launchPipeline(struct command_t *command)
+{
+	pid_t pids[maxPipelineStages];
+	int stageCount = 0, inputFd = -1, fd[2];
+	struct placement_t placement = launchPlacement;
+	if (command->background && spreadBackground && !placement.hasCpus)
+		spreadPlacement(&placement);
+
+	fflush(stdout);
+	for (struct command_t *stage = command; stage != NULL; stage = stage->next)
+	{
+		const struct builtin_t *builtin = findBuiltin(stage->name);
+		if (builtin == NULL)
+			resolveCommand(stage->name); // cached in the shell, so the next fork finds it without a search
+		if (stageCount == maxPipelineStages)
+		{
+			fprintf(stderr, "-%s: too many commands in the pipeline\n", sysname);
+			break;
+		}
+		if (stage->next != NULL && pipe(fd) == -1)
+		{
+			fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+			break;
+		}
+
+		unsigned long long forkStart = traceBegin();
+		pid_t pid = fork();
+		if (pid == 0) // child
+		{
+			traceEnd("fork", forkStart, stage->name);
+			if (inputFd != -1)
+			{
+				dup2(inputFd, STDIN_FILENO);
+				close(inputFd);
+			}
+			if (stage->next != NULL)
+			{
+				dup2(fd[WRITE_END], STDOUT_FILENO);
+				close(fd[READ_END]);
+				close(fd[WRITE_END]);
+			}
+			else if (captureWriteFd != -1)
+				dup2(captureWriteFd, STDOUT_FILENO);
+			if (captureWriteFd != -1)
+			{
+				close(captureWriteFd);
+				close(captureReadFd);
+			}
+			if (placement.active)
+				applyPlacement(&placement);
+			runInChild(stage, builtin);
+		}
+
+		if (inputFd != -1)
+			close(inputFd);
+		if (stage->next != NULL)
+		{
+			close(fd[WRITE_END]);
+			inputFd = fd[READ_END];
+		}
+		if (pid < 0)
+		{
+			fprintf(stderr, "-%s: fork: %s\n", sysname, strerror(errno));
+			break;
+		}
+		pids[stageCount++] = pid;
+	}
+	if (inputFd != -1)
+		close(inputFd);
+	//only the children keep the capture pipe open, so reading it ends when they are done
+	bool capturing = captureWriteFd != -1;
+	if (capturing)
+	{
+		close(captureWriteFd);
+		captureWriteFd = -1;
+	}
+	if (stageCount == 0)
+		return SUCCESS;
+
+	if (command->background)
+	{
+		char name[maxJobNameLength];
+		formatCommand(command, name, sizeof(name));
+		int id = addJob(pids, stageCount, name, periodicLaunch);
+		if (id == -1)
+			fprintf(stderr, "-%s: too many jobs, %s is not tracked\n", sysname, name);
+		else if (!periodicLaunch)
+			printf("[%d] %d\n", id, pids[stageCount - 1]);
+		return SUCCESS;
+	}
+
+	if (capturing)
+		drainCapture();
+	for (int i = 0; i < stageCount; i++)
+		lastStatus = waitForChild(pids[i]);
+	return SUCCESS;
+}
+
+/*
+   Lists the background jobs that are still running.
+   */
+int builtinJobs(struct command_t *command){
+	for(int i = 0; i < maxJobs; i++){
+		if(jobs[i].id == 0 || jobs[i].quiet) continue;
+		printf("[%d] Running\t%s\n", jobs[i].id, jobs[i].name);
+	}
+	return SUCCESS;
+}
+
+struct parallel_job_t
+{
+	pid_t pid;
+	int fd;				// read end of the output pipe, -1 once it is drained
+	bool done;
+	int status;
+	char *output;
+	size_t outputLen;
+	size_t outputSize;
+};
+
+/*
+   Makes a command out of the command words of parallel and one input, the input replaces
+   every {} in the words or is appended as the last argument when there is none.
+   */
+struct command_t *buildParallelCommand(char **words, int wordCount, const char *input){
+	struct command_t *command = calloc(1, sizeof(struct command_t));
+	bool replaced = false;
+
+	command->args = malloc(sizeof(char *) * (wordCount + 1));
+	for(int i = 0; i < wordCount; i++){
+		char *word = strdup(words[i]);
+		char *placeholder;
+		size_t searchFrom = 0;
+		//the input itself may contain {}, so the search continues after what was inserted
+		while((placeholder = strstr(word + searchFrom, "{}")) != NULL){
+			size_t prefix = placeholder - word;
+			char *next = malloc(strlen(word) + strlen(input) - 1);
+			memcpy(next, word, prefix);
+			strcpy(next + prefix, input);
+			strcat(next, placeholder + 2);
+			free(word);
+			word = next;
+			searchFrom = prefix + strlen(input);
+			replaced = true;
+		}
+		if(i == 0) command->name = word;
+		else command->args[command->arg_count++] = word;
+	}
+	if(!replaced) command->args[command->arg_count++] = strdup(input);
+	return command;
+}
+
+void startParallelJob(struct parallel_job_t *job, char **words, int wordCount, const char *input){
+	int fd[2];
+	if(pipe2(fd, O_CLOEXEC) == -1){
+		job->done = true;
+		job->status = 127;
+		job->fd = -1;
+		return;
+	}
+	struct command_t *command = buildParallelCommand(words, wordCount, input);
+
+	fflush(stdout);
+	job->pid = fork();
+	if(job->pid == 0){//child, stdout and stderr of the job are collected together
+		dup2(fd[WRITE_END], STDOUT_FILENO);
+		dup2(fd[WRITE_END], STDERR_FILENO);
+		runInChild(command, findBuiltin(command->name));
+	}
+	close(fd[WRITE_END]);
+	free_command(command);
+	job->fd = fd[READ_END];
+	if(job->pid < 0){
+		close(job->fd);
+		job->fd = -1;
+		job->done = true;
+		job->status = 127;
+	}
+}
+
+/*
+   Reads what a job wrote, returns false once its output is closed and the job is reaped.
+   */
+bool readParallelJob(struct parallel_job_t *job){
+	if(job->outputSize - job->outputLen < 4096){
+		job->outputSize = job->outputSize ? job->outputSize * 2 : 8192;
+		job->output = realloc(job->output, job->outputSize);
+	}
+	ssize_t len = read(job->fd, job->output + job->outputLen, job->outputSize - job->outputLen);
+	if(len > 0){
+		job->outputLen += len;
+		return true;
+	}
+	if(len < 0 && errno == EINTR) return true;
+
+	close(job->fd);
+	job->fd = -1;
+	job->status = waitForChild(job->pid);
+	job->done = true;
+	return false;
+}
+
+void emitParallelJob(struct parallel_job_t *job){
+	size_t written = 0;
+	while(written < job->outputLen){
+		ssize_t len = write(STDOUT_FILENO, job->output + written, job->outputLen - written);
+		if(len <= 0 && errno != EINTR) break;
+		if(len > 0) written += len;
+	}
+	free(job->output);
+	job->output = NULL;
+}
+
+/*
+   parallel [-j n] [-k] <command> ::: <inputs> runs the command once per input, at most n at a time.
+   Without ::: the inputs are the lines of stdin. A command given as one quoted word is split into
+   words, so parallel 'cp {} {}.bak' works as well. The output of every job is collected and printed
+   in one piece when it finishes, or in input order with -k. Failed jobs make the status non zero.
+   */
+int builtinParallel(struct command_t *command){
+	int workers = defaultParallelJobs, first = 0;
+	bool keepOrder = false;
+
+	for(; first < command->arg_count && command->args[first][0] == '-'; first++){
+		if(strcmp(command->args[first], "-k") == 0) keepOrder = true;
+		else if(strcmp(command->args[first], "-j") == 0 && first + 1 < command->arg_count) workers = atoi(command->args[++first]);
+		else if(strncmp(command->args[first], "-j", 2) == 0) workers = atoi(command->args[first] + 2);
+		else break;
+	}
+	if(workers < 1) workers = 1;
+
+	int separator = first;
+	while(separator < command->arg_count && strcmp(command->args[separator], ":::") != 0) separator++;
+	int wordCount = separator - first;
+	if(wordCount == 0){
+		printf("-%s: %s: Insufficient arguments\n", sysname, command->name);
+		return SUCCESS;
+	}
+
+	//a single quoted command, like parallel 'cp {} {}.bak', is split into its words
+	char **words = command->args + first, *commandLine = NULL;
+	if(wordCount == 1 && strpbrk(words[0], " \t") != NULL){
+		char *cursor, *word;
+		commandLine = cursor = strdup(words[0]);
+		words = malloc(sizeof(char *) * (strlen(commandLine) / 2 + 1));
+		wordCount = 0;
+		while((word = nextWord(&cursor)) != NULL){
+			removeQuotes(word);
+			words[wordCount++] = word;
+		}
+	}
+
+	char **inputs;
+	int total = 0;
+	if(separator < command->arg_count){
+		inputs = command->args + separator + 1;
+		total = command->arg_count - separator - 1;
+	}else{
+		//inputs are the non empty lines of stdin
+		char *line = NULL;
+		size_t lineSize = 0;
+		int inputSize = 0;
+		inputs = NULL;
+		while(getline(&line, &lineSize, stdin) > 0){
+			line[strcspn(line, "\r\n")] = 0;
+			if(line[0] == 0) continue;
+			if(total == inputSize){
+				inputSize = inputSize ? inputSize * 2 : 64;
+				inputs = realloc(inputs, sizeof(char *) * inputSize);
+			}
+			inputs[total++] = strdup(line);
+		}
+		free(line);
+		clearerr(stdin);
+	}
+
+	struct parallel_job_t *parallelJobs = calloc(total ? total : 1, sizeof(struct parallel_job_t));
+	struct pollfd fds[workers];
+	int pollJobs[workers];
+	int started = 0, running = 0, finished = 0, emitted = 0, failed = 0;
+
+	while(finished < total){
+		for(; running < workers && started < total; started++){
+			startParallelJob(&parallelJobs[started], words, wordCount, inputs[started]);
+			if(!parallelJobs[started].done) running++;
+			else finished++;
+		}
+
+		int count = 0;
+		for(int i = emitted; i < started && count < workers; i++){
+			if(parallelJobs[i].fd < 0) continue;
+			fds[count].fd = parallelJobs[i].fd;
+			fds[count].events = POLLIN;
+			pollJobs[count++] = i;
+		}
+		if(count > 0 && poll(fds, count, -1) < 0 && errno != EINTR) break;
+
+		for(int i = 0; i < count; i++){
+			if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			struct parallel_job_t *job = &parallelJobs[pollJobs[i]];
+			if(readParallelJob(job)) continue;
+			running--;
+			finished++;
+			if(!keepOrder) emitParallelJob(job);
+		}
+
+		//in order mode a job is printed once all the jobs before it are printed
+		while(emitted < started && parallelJobs[emitted].done){
+			if(keepOrder) emitParallelJob(&parallelJobs[emitted]);
+			if(parallelJobs[emitted].status != 0) failed++;
+			emitted++;
+		}
+	}
+
+	if(failed > 0) fprintf(stderr, "-%s: %s: %d of %d jobs failed\n", sysname, command->name, failed, total);
+	lastStatus = failed > 125 ? 125 : failed;
+
+	free(parallelJobs);
+	if(commandLine != NULL){
+		free(commandLine);
+		free(words);
+	}
+	if(separator == command->arg_count){
+		for(int i = 0; i < total; i++) free(inputs[i]);
+		free(inputs);
+	}
+	return SUCCESS;
+}
+
+/*
+   Memoization of deterministic commands. The key hashes the words of the command, the
+   selected environment variables, the working directory and the mtime and size of the
+   declared input files. An entry is a file named after the key: a header with the exit
+   status, then the output of the command.
+   */
+struct memo_key_t
+{
+	unsigned long long first;	// FNV-1a
+	unsigned long long second;	// FNV-1, a different walk of the same bytes
+};
+
+struct memo_header_t
+{
+	char magic[8];
+	int status;
+	unsigned int reserved;
+	unsigned long long outputLen;
+};
+
+void hashMemoBytes(struct memo_key_t *key, const void *data, size_t len){
+	const unsigned char *bytes = data;
+	for(size_t i = 0; i < len; i++){
+		key->first ^= bytes[i];
+		key->first *= 1099511628211ULL;
+		key->second *= 1099511628211ULL;
+		key->second ^= bytes[i];
+	}
+}
+
+// strings are hashed with their terminator, so "ab" "c" and "a" "bc" differ
+void hashMemoString(struct memo_key_t *key, const char *text){
+	hashMemoBytes(key, text, strlen(text) + 1);
+}
+
+/*
+   Reads SHELLFYRE_MEMO_LIMIT, a size in bytes with an optional k, m or g suffix.
+   */
+unsigned long long memoLimit(){
+	char *limit = getenv("SHELLFYRE_MEMO_LIMIT"), *end;
+	if(limit == NULL) return defaultMemoLimit;
+	unsigned long long bytes = strtoull(limit, &end, 10);
+	switch(tolower((unsigned char)*end)){
+		case 'g': bytes <<= 10; // fall through
+		case 'm': bytes <<= 10; // fall through
+		case 'k': bytes <<= 10;
+	}
+	return end == limit ? defaultMemoLimit : bytes;
+}
+
+struct memo_entry_t
+{
+	char name[64];
+	off_t size;
+	struct timespec used;
+};
+
+int compareMemoEntries(const void *first, const void *second){
+	const struct memo_entry_t *a = first, *b = second;
+	if(a->used.tv_sec != b->used.tv_sec) return a->used.tv_sec < b->used.tv_sec ? -1 : 1;
+	return (a->used.tv_nsec > b->used.tv_nsec) - (a->used.tv_nsec < b->used.tv_nsec);
+}
+
+/*
+   Removes the least recently used entries until the cache fits in limit bytes.
+   Hits touch the mtime of their entry, so the mtime is the last use.
+   */
+void evictMemoEntries(const char *cachePath, unsigned long long limit){
+	DIR *dir = opendir(cachePath);
+	if(dir == NULL) return;
+	struct memo_entry_t *entries = NULL;
+	int count = 0, capacity = 0;
+	unsigned long long total = 0;
+	struct dirent *entry;
+	struct stat st;
+
+	while((entry = readdir(dir)) != NULL){
+		//temporary files of running memos have a dot in their name
+		if(strchr(entry->d_name, '.') != NULL || strlen(entry->d_name) >= sizeof(entries->name)) continue;
+		if(fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) continue;
+		if(count == capacity){
+			capacity = capacity ? capacity * 2 : 64;
+			entries = realloc(entries, sizeof(struct memo_entry_t) * capacity);
+		}
+		strcpy(entries[count].name, entry->d_name);
+		entries[count].size = st.st_size;
+		entries[count].used = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+
+	if(total > limit){
+		qsort(entries, count, sizeof(struct memo_entry_t), compareMemoEntries);
+		for(int i = 0; i < count && total > limit; i++)
+			if(unlinkat(dirfd(dir), entries[i].name, 0) == 0) total -= entries[i].size;
+	}
+	free(entries);
+	closedir(dir);
+}
+
+/*
+   Writes the output of a cached entry to stdout with sendfile, without copying it through
+   the shell. Returns -1 when the entry is missing or damaged.
+   */
+int replayMemoEntry(const char *entryPath){
+	struct memo_header_t header;
+	int fd = open(entryPath, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	if(read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, memoMagic, sizeof(header.magic)) != 0){
+		close(fd);
+		return -1;
+	}
+
+	fflush(stdout);
+	off_t offset = sizeof(header);
+	unsigned long long remaining = header.outputLen;
+	while(remaining > 0){
+		ssize_t sent = sendfile(STDOUT_FILENO, fd, &offset, remaining);
+		if(sent < 0 && errno == EINTR) continue;
+		if(sent <= 0) break;
+		remaining -= sent;
+	}
+	//stdout opened with O_APPEND is not supported by sendfile, copying the rest instead
+	if(remaining > 0 && lseek(fd, offset, SEEK_SET) == offset){
+		char buffer[4096];
+		ssize_t count;
+		while(remaining > 0 && (count = read(fd, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer))) > 0){
+			if(write(STDOUT_FILENO, buffer, count) != count) break;
+			remaining -= count;
+		}
+	}
+
+	futimens(fd, NULL);
+	close(fd);
+	lastStatus = header.status;
+	return 0;
+}
+
+/*
+   Runs a command with its output captured into a temporary entry, which is renamed into
+   place once the command is done, so a concurrent memo never replays half an output.
+   */
+void storeMemoEntry(struct command_t *command, const char *cachePath, const char *entryPath){
+	char temporaryPath[PATH_MAX + 64];
+	struct memo_header_t header;
+	int fd[2];
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp", entryPath, (int)getpid());
+
+	int fileFd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fileFd >= 0 && (lseek(fileFd, sizeof(header), SEEK_SET) < 0 || pipe2(fd, O_CLOEXEC) == -1)){
+		close(fileFd);
+		unlink(temporaryPath);
+		fileFd = -1;
+	}
+	if(fileFd < 0){
+		//the command still runs when the cache cannot be written
+		launchPipeline(command);
+		return;
+	}
+
+	captureWriteFd = fd[WRITE_END];
+	captureReadFd = fd[READ_END];
+	captureFileFd = fileFd;
+	captureFailed = false;
+	captureLen = 0;
+	launchPipeline(command);
+	if(captureWriteFd != -1) close(captureWriteFd);
+	close(captureReadFd);
+	captureWriteFd = captureReadFd = captureFileFd = -1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, memoMagic, sizeof(header.magic));
+	header.status = lastStatus;
+	header.outputLen = captureLen;
+	bool stored = !captureFailed && pwrite(fileFd, &header, sizeof(header), 0) == sizeof(header);
+	close(fileFd);
+	if(stored && rename(temporaryPath, entryPath) == 0) evictMemoEntries(cachePath, memoLimit());
+	else unlink(temporaryPath);
+}
+
+/*
+   memo [-e NAME]... [-i file]... <command...> runs a deterministic command once and replays
+   its output and exit status while the command, the variables given with -e, the working
+   directory and the files given with -i stay the same. The cache is kept in
+   SHELLFYRE_MEMO_CACHE or shellfyre/memo under the cache directory.
+   */
+int builtinMemo(struct command_t *command){
+	struct memo_key_t key = {14695981039346656037ULL, 14695981039346656037ULL ^ 0x5bd1e995ULL};
+	char cachePath[PATH_MAX], entryPath[PATH_MAX + 40];
+	int first = 0;
+
+	while(first < command->arg_count && command->args[first][0] == '-'){
+		char *option = command->args[first];
+		if(strcmp(option, "--") == 0){
+			first++;
+			break;
+		}
+		if((strcmp(option, "-e") != 0 && strcmp(option, "-i") != 0) || first + 1 == command->arg_count){
+			printf("-%s: %s: use memo [-e NAME]... [-i file]... <command...>\n", sysname, command->name);
+			lastStatus = 2;
+			return SUCCESS;
+		}
+
+		char *value = command->args[first + 1];
+		hashMemoString(&key, option);
+		hashMemoString(&key, value);
+		if(option[1] == 'e'){
+			const char *variable = getVariable(value);
+			hashMemoString(&key, variable != NULL ? variable : "");
+			hashMemoBytes(&key, &(char){variable != NULL}, 1);
+		}else{
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			stat(value, &st);
+			hashMemoBytes(&key, &st.st_mtim, sizeof(st.st_mtim));
+			hashMemoBytes(&key, &st.st_size, sizeof(st.st_size));
+		}
+		first += 2;
+	}
+	if(first >= command->arg_count){
+		printf("-%s: %s: no command to run\n", sysname, command->name);
+		lastStatus = 2;
+		return SUCCESS;
+	}
+
+	const struct builtin_t *builtin = findBuiltin(command->args[first]);
+	if(builtin != NULL && !builtin->pipeable){
+		printf("-%s: %s: %s cannot be memoized\n", sysname, command->name, command->args[first]);
+		lastStatus = 2;
+		return SUCCESS;
+	}
+
+	char *cwd = getcwd(NULL, 0);
+	hashMemoString(&key, cwd != NULL ? cwd : "");
+	free(cwd);
+	for(int i = first; i < command->arg_count; i++) hashMemoString(&key, command->args[i]);
+
+	struct command_t *memoized = calloc(1, sizeof(struct command_t));
+	memoized->name = strdup(command->args[first]);
+	memoized->args = malloc(sizeof(char *) * (command->arg_count - first));
+	for(int i = first + 1; i < command->arg_count; i++) memoized->args[memoized->arg_count++] = strdup(command->args[i]);
+
+	if(shellfyreCacheDir("SHELLFYRE_MEMO_CACHE", "memo", cachePath, sizeof(cachePath)) != 0){
+		launchPipeline(memoized);
+	}else{
+		snprintf(entryPath, sizeof(entryPath), "%s/%016llx%016llx", cachePath, key.first, key.second);
+		if(replayMemoEntry(entryPath) == 0){
+			traceInstant("memo_hit", memoized->name);
+		}else{
+			traceInstant("memo_miss", memoized->name);
+			storeMemoEntry(memoized, cachePath, entryPath);
+		}
+	}
+	free_command(memoized);
+	return SUCCESS;
+}
+
+/*
+   trace on [file] records the phases of every command until trace off, which writes
+   them to the file (shellfyre-trace.json by default) in Chrome trace_event format.
+   */
+int builtinTrace(struct command_t *command){
+	if(strcmp(command->args[0], "on") == 0){
+		const char *path = command->arg_count > 1 ? command->args[1] : defaultTraceFile;
+		if(traceStart(path) != 0) printf("-%s: %s: cannot allocate the trace buffer\n", sysname, command->name);
+	}else if(strcmp(command->args[0], "off") == 0){
+		if(traceBuffer != NULL && traceStop() == 0) printf("Trace written to %s\n", tracePath);
+	}else{
+		printf("-%s: %s: use trace on [file] or trace off\n", sysname, command->name);
+	}
+	return SUCCESS;
+}
+
+struct shell_var_t
+{
+	char *name;				// NULL for an empty bucket
+	char *value;
+	bool exported;			// copied to the environment of the commands
+};
+
+// open addressing table of shell variables, never filled above half of the buckets
+static struct shell_var_t variableTable[variableBuckets];
+static int variableCount = 0;
+
+struct shell_var_t *findVariable(const char *name){
+	unsigned int bucket = hashBuiltinName(name) & (variableBuckets - 1);
+	while(variableTable[bucket].name != NULL){
+		if(strcmp(variableTable[bucket].name, name) == 0) return &variableTable[bucket];
+		bucket = (bucket + 1) & (variableBuckets - 1);
+	}
+	return NULL;
+}
+
+/*
+   Returns the value of a shell variable, or of the environment variable the shell started with.
+   */
+const char *getVariable(const char *name){
+	struct shell_var_t *variable = findVariable(name);
+	return variable != NULL ? variable->value : getenv(name);
+}
+
+/*
+   Sets a shell variable. Variables of the environment stay exported, and the environment
+   is only written when the value of an exported variable actually changes.
+   Returns -1 when the table is full.
+   */
+int setVariable(const char *name, const char *value){
+	struct shell_var_t *variable = findVariable(name);
+	if(variable != NULL){
+		if(strcmp(variable->value, value) == 0) return 0;
+		free(variable->value);
+		variable->value = strdup(value);
+		if(variable->exported) setenv(name, value, 1);
+		return 0;
+	}
+	if(variableCount >= variableBuckets / 2) return -1;
+
+	unsigned int bucket = hashBuiltinName(name) & (variableBuckets - 1);
+	while(variableTable[bucket].name != NULL) bucket = (bucket + 1) & (variableBuckets - 1);
+	const char *current = getenv(name);
+	variableTable[bucket].name = strdup(name);
+	variableTable[bucket].value = strdup(value);
+	variableTable[bucket].exported = current != NULL;
+	variableCount++;
+	if(current != NULL && strcmp(current, value) != 0) setenv(name, value, 1);
+	return 0;
+}
+
+/*
+   Removes a variable from the table and the environment, moving the rest of its cluster
+   back like unregisterBuiltin does.
+   */
+void unsetVariable(const char *name){
+	unsetenv(name);
+	struct shell_var_t *variable = findVariable(name);
+	if(variable == NULL) return;
+
+	unsigned int bucket = variable - variableTable;
+	free(variable->name);
+	free(variable->value);
+	variable->name = NULL;
+	variableCount--;
+	for(bucket = (bucket + 1) & (variableBuckets - 1); variableTable[bucket].name != NULL; bucket = (bucket + 1) & (variableBuckets - 1)){
+		struct shell_var_t moved = variableTable[bucket];
+		variableTable[bucket].name = NULL;
+		unsigned int target = hashBuiltinName(moved.name) & (variableBuckets - 1);
+		while(variableTable[target].name != NULL) target = (target + 1) & (variableBuckets - 1);
+		variableTable[target] = moved;
+	}
+}
+
+bool isVariableName(const char *name, size_t len){
+	if(len == 0 || len >= maxVariableName || !(isalpha((unsigned char)name[0]) || name[0] == '_')) return false;
+	for(size_t i = 1; i < len; i++)
+		if(!(isalnum((unsigned char)name[i]) || name[i] == '_')) return false;
+	return true;
+}
+
+// NAME=value words, the name part is checked the same way as $NAME
+bool isAssignment(const char *word){
+	const char *equals = strchr(word, '=');
+	return equals != NULL && isVariableName(word, equals - word);
+}
+
+/*
+   Assigns NAME=value, returns -1 when it is not an assignment or the table is full.
+   */
+int assignVariable(const char *word){
+	char name[maxVariableName];
+	const char *equals = strchr(word, '=');
+	if(!isAssignment(word)) return -1;
+	snprintf(name, sizeof(name), "%.*s", (int)(equals - word), word);
+	return setVariable(name, equals + 1);
+}
+
+/*
+   export NAME[=value]... marks variables to be passed to the commands, without
+   arguments it lists the exported variables.
+   */
+int builtinExport(struct command_t *command){
+	if(command->arg_count == 0){
+		for(int i = 0; i < variableBuckets; i++)
+			if(variableTable[i].name != NULL && variableTable[i].exported)
+				printf("%s=%s\n", variableTable[i].name, variableTable[i].value);
+		return SUCCESS;
+	}
+	for(int i = 0; i < command->arg_count; i++){
+		char *word = command->args[i];
+		if(isAssignment(word)) assignVariable(word);
+		else if(!isVariableName(word, strlen(word))){
+			printf("-%s: %s: %s: not a valid name\n", sysname, command->name, word);
+			lastStatus = 1;
+			continue;
+		}else if(findVariable(word) == NULL && setVariable(word, getenv(word) ? getenv(word) : "") != 0){
+			printf("-%s: %s: too many variables\n", sysname, command->name);
+			lastStatus = 1;
+			continue;
+		}
+
+		char name[maxVariableName];
+		snprintf(name, sizeof(name), "%.*s", (int)strcspn(word, "="), word);
+		struct shell_var_t *variable = findVariable(name);
+		if(variable != NULL && !variable->exported){
+			variable->exported = true;
+			setenv(variable->name, variable->value, 1);
+		}
+	}
+	return SUCCESS;
+}
+
+int builtinUnset(struct command_t *command){
+	for(int i = 0; i < command->arg_count; i++) unsetVariable(command->args[i]);
+	return SUCCESS;
+}
+
+// growable text the expansion is written into
+struct expansion_t
+{
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+void reserveExpansion(struct expansion_t *out, size_t extra){
+	if(out->len + extra + 1 <= out->size) return;
+	size_t size = out->size ? out->size : 256;
+	while(out->len + extra + 1 > size) size *= 2;
+	out->data = realloc(out->data, size);
+	out->size = size;
+}
+
+void appendExpansion(struct expansion_t *out, const char *text, size_t len){
+	reserveExpansion(out, len);
+	memcpy(out->data + out->len, text, len);
+	out->len += len;
+	out->data[out->len] = 0;
+}
+
+/*
+   Finds the ) closing the $( at text, skipping nested parentheses and quoted text.
+   Returns NULL when it is not closed.
+   */
+const char *findSubstitutionEnd(const char *text){
+	int depth = 1;
+	char quote = 0;
+	for(; *text; text++){
+		if(quote){
+			if(*text == quote) quote = 0;
+		}else if(*text == '\'' || *text == '"') quote = *text;
+		else if(*text == '(') depth++;
+		else if(*text == ')' && --depth == 0) return text;
+	}
+	return NULL;
+}
+
+/*
+   Runs the command line of a $(...) substitution and appends what it prints to out.
+   The output is read from a pipe straight into the expansion buffer. A single command is
+   exec'ed in the forked child itself, so a substitution costs one fork.
+   */
+void runSubstitution(const char *text, size_t len, struct expansion_t *out){
+	int fd[2];
+	if(pipe(fd) == -1){
+		fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+		return;
+	}
+	unsigned long long substitutionStart = traceBegin();
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0){
+		close(fd[READ_END]);
+		dup2(fd[WRITE_END], STDOUT_FILENO);
+		close(fd[WRITE_END]);
+
+		char *line = strndup(text, len);
+		struct command_t *command = calloc(1, sizeof(struct command_t));
+		if(expandAndParse(line, command) != 0) exit(1);
+		if(command->name[0] == 0) exit(0);
+		if(command->next == NULL && !command->background) runInChild(command, findBuiltin(command->name));
+		process_command(command);
+		fflush(stdout);
+		exit(lastStatus);
+	}
+	close(fd[WRITE_END]);
+	if(pid < 0){
+		fprintf(stderr, "-%s: fork: %s\n", sysname, strerror(errno));
+		close(fd[READ_END]);
+		return;
+	}
+
+	while(1){
+		reserveExpansion(out, 4096);
+		ssize_t read_len = read(fd[READ_END], out->data + out->len, out->size - out->len - 1);
+		if(read_len < 0 && errno == EINTR) continue;
+		if(read_len <= 0) break;
+		out->len += read_len;
+	}
+	close(fd[READ_END]);
+	lastStatus = waitForChild(pid);
+	out->data[out->len] = 0;
+	traceEnd("substitution", substitutionStart, NULL);
+}
+
+/*
+   Appends an expanded value, escaped so parse_command reads it back as plain text.
+   Quotes and the characters of pipes and redirections never take effect from a value.
+   Unquoted values are split into words at whitespace, except in NAME=value words.
+   */
+void appendValue(struct expansion_t *out, const char *value, size_t len, char quote, bool oneWord){
+	const char *special = quote == '"' ? "\"\\" : oneWord ? "\"'\\|<>&{ \t" : "\"'\\|<>&{";
+	reserveExpansion(out, len * 2);
+	for(size_t i = 0; i < len; i++){
+		if(strchr(special, value[i]) != NULL) out->data[out->len++] = '\\';
+		out->data[out->len++] = value[i];
+	}
+	out->data[out->len] = 0;
+}
+
+/*
+   Expands ~, $NAME, ${NAME}, $?, $$ and $(command) of a command line into out.
+   Nothing is expanded between single quotes or after a backslash.
+   Returns -1 when a substitution or a ${ is not closed.
+   */
+int expandLine(const char *line, struct expansion_t *out){
+	char quote = 0, name[maxVariableName], number[24];
+	bool wordStart = true, assignment = false;
+	reserveExpansion(out, strlen(line));
+	out->data[out->len] = 0;
+
+	for(const char *p = line; *p; ){
+		const char *value = NULL;
+		size_t skip = 1;
+
+		if(wordStart){
+			size_t len = strcspn(p, "= \t\"'$");
+			assignment = p[len] == '=' && isVariableName(p, len);
+		}
+		wordStart = !quote && (*p == ' ' || *p == '\t');
+
+		if(quote != '"' && *p == '\''){
+			quote = quote ? 0 : '\'';
+		}else if(quote != '\'' && *p == '"'){
+			quote = quote ? 0 : '"';
+		}else if(quote == '\''){
+		}else if(*p == '\\' && p[1] != 0){
+			appendExpansion(out, p, 2);
+			p += 2;
+			continue;
+		}else if(*p == '~' && !quote && (p == line || p[-1] == ' ' || p[-1] == '\t')){
+			//~ is the home directory and ~user the one of another user
+			size_t len = strcspn(p + 1, "/ \t");
+			if(len == 0) value = getVariable("HOME");
+			else if(len < maxVariableName){
+				snprintf(name, sizeof(name), "%.*s", (int)len, p + 1);
+				struct passwd *entry = getpwnam(name);
+				if(entry != NULL) value = entry->pw_dir;
+			}
+			if(value != NULL){
+				appendValue(out, value, strlen(value), quote, true);
+				p += len + 1;
+				continue;
+			}
+		}else if(*p == '$' && p[1] == '('){
+			const char *end = findSubstitutionEnd(p + 2);
+			if(end == NULL){
+				fprintf(stderr, "-%s: missing ) of $(\n", sysname);
+				return -1;
+			}
+			struct expansion_t output = {NULL, 0, 0};
+			runSubstitution(p + 2, end - p - 2, &output);
+			//trailing newlines are dropped, the others split words unless quoted
+			while(output.len > 0 && output.data[output.len - 1] == '\n') output.len--;
+			for(size_t i = 0; !quote && !assignment && i < output.len; i++)
+				if(output.data[i] == '\n') output.data[i] = ' ';
+			appendValue(out, output.data ? output.data : "", output.len, quote, assignment);
+			free(output.data);
+			p = end + 1;
+			continue;
+		}else if(*p == '$' && (p[1] == '?' || p[1] == '$')){
+			snprintf(number, sizeof(number), "%d", p[1] == '?' ? lastStatus : (int)getpid());
+			value = number;
+			skip = 2;
+		}else if(*p == '$' && p[1] == '{'){
+			size_t len = strcspn(p + 2, "}");
+			if(p[2 + len] != '}'){
+				fprintf(stderr, "-%s: missing } of ${\n", sysname);
+				return -1;
+			}
+			if(isVariableName(p + 2, len)){
+				snprintf(name, sizeof(name), "%.*s", (int)len, p + 2);
+				value = getVariable(name) ? getVariable(name) : "";
+				skip = len + 3;
+			}
+		}else if(*p == '$' && (isalpha((unsigned char)p[1]) || p[1] == '_')){
+			size_t len = 1;
+			while(isalnum((unsigned char)p[1 + len]) || p[1 + len] == '_') len++;
+			if(len < maxVariableName){
+				snprintf(name, sizeof(name), "%.*s", (int)len, p + 1);
+				value = getVariable(name) ? getVariable(name) : "";
+				skip = len + 1;
 			}
 		}
 
-		// If an executable isn't found, prints error message
-		printf("-%s: %s: command not found\n", sysname, command->name);
-		exit(0);
+		if(value != NULL) appendValue(out, value, strlen(value), quote, assignment);
+		else appendExpansion(out, p, skip);
+		p += skip;
 	}
-	else
+	return 0;
+}
+
+/*
+   Expands a command line and parses it into command. On an expansion error the
+   command is left empty, which process_command skips.
+   */
+int expandAndParse(const char *line, struct command_t *command){
+	struct expansion_t expanded = {NULL, 0, 0};
+	unsigned long long expandStart = traceBegin();
+	char *aliased = applyAliases(line);
+	int code = expandLine(aliased != NULL ? aliased : line, &expanded);
+	free(aliased);
+	traceEnd("expand", expandStart, NULL);
+	if(code != 0){
+		free(expanded.data);
+		command->name = strdup("");
+		lastStatus = 1;
+		return -1;
+	}
+	parse_command(expanded.data, command);
+	free(expanded.data);
+	return 0;
+}
+
+int process_command(struct command_t *command)
+{
+	if (strcmp(command->name, "") == 0)
+		return SUCCESS;
+
+	//a line of NAME=value words only sets shell variables
+	bool assignments = command->next == NULL && !command->background && isAssignment(command->name);
+	for (int i = 0; assignments && i < command->arg_count; i++)
+		assignments = isAssignment(command->args[i]);
+	if (assignments)
+	{
+		lastStatus = 0;
+		if (assignVariable(command->name) != 0)
+			lastStatus = 1;
+		for (int i = 0; i < command->arg_count; i++)
+			if (assignVariable(command->args[i]) != 0)
+				lastStatus = 1;
+		if (lastStatus != 0)
+			printf("-%s: too many variables\n", sysname);
+		return SUCCESS;
+	}
+
+	//builtins are found through the registry with a single hash lookup
+	unsigned long long dispatchStart = traceBegin();
+	const struct builtin_t *builtin = findBuiltin(command->name);
+	traceEnd("dispatch", dispatchStart, command->name);
+
+	//pin or sched in front of a pipeline places every stage of it
+	if (builtin != NULL && builtin->handler == builtinPin)
+	{
+		struct placement_t placement, saved = launchPlacement;
+		int stripped = stripPlacementPrefix(command, &placement);
+		if (stripped == -1)
+		{
+			lastStatus = 2;
+			return SUCCESS;
+		}
+		if (stripped == 0)
+		{
+			launchPlacement = placement;
+			int code = process_command(command);
+			launchPlacement = saved;
+			return code;
+		}
+	}
+	if (builtin != NULL && launchPlacement.active && !builtin->pipeable)
+	{
+		printf("-%s: %s: cannot be placed\n", sysname, command->name);
+		return SUCCESS;
+	}
+
+	for (struct command_t *stage = command->next; stage != NULL; stage = stage->next)
+	{
+		const struct builtin_t *stageBuiltin = findBuiltin(stage->name);
+		if (stageBuiltin != NULL && !stageBuiltin->pipeable)
+		{
+			printf("-%s: %s: cannot be used in a pipeline\n", sysname, stage->name);
+			return SUCCESS;
+		}
+	}
+	if (builtin != NULL && command->next != NULL && !builtin->pipeable)
+	{
+		printf("-%s: %s: cannot be used in a pipeline\n", sysname, command->name);
+		return SUCCESS;
+	}
+
+	//a builtin alone runs in the shell, unless it is sent to the background or redirected
+	bool redirected = command->redirects[0] || command->redirects[1] || command->redirects[2];
+	if (builtin != NULL && command->next == NULL && !builtin->backgroundable && (command->background || redirected))
 	{
-		/// TODO: Wait for child to finish if command is not running in background
-		if(!command->background) wait(NULL);
+		printf("-%s: %s: cannot be %s\n", sysname, command->name, command->background ? "run in the background" : "redirected");
+		lastStatus = 2;
+		return SUCCESS;
+	}
+	if (builtin != NULL && command->next == NULL && !launchPlacement.active &&
+			!command->background && !redirected)
+	{
+		if (command->arg_count < builtin->minArgs)
+			printf("-%s: %s: Insufficient arguments\n", sysname, command->name);
+		else if (builtin->maxArgs >= 0 && command->arg_count > builtin->maxArgs)
+			printf("-%s: %s: Too many arguments\n", sysname, command->name);
+		else
+		{
+			unsigned long long builtinStart = traceBegin();
+			lastStatus = 0;
+			int code = builtin->handler(command);
+			traceEnd("builtin", builtinStart, command->name);
+			return code;
+		}
+		lastStatus = 2;
+		return SUCCESS;
+	}
+
+	return launchPipeline(command);
+}
+
+/*
+   Aliases replace the first word of a command with their text before it is expanded.
+   */
+struct alias_t
+{
+	char *name;					// NULL for an empty bucket
+	char *value;
+};
+
+static struct alias_t aliasTable[aliasBuckets];
+static int aliasCount = 0;
+
+struct alias_t *findAlias(const char *name, size_t len){
+	char key[maxVariableName];
+	if(len >= sizeof(key)) return NULL;
+	memcpy(key, name, len);
+	key[len] = 0;
+	unsigned int bucket = hashBuiltinName(key) & (aliasBuckets - 1);
+	for(; aliasTable[bucket].name != NULL; bucket = (bucket + 1) & (aliasBuckets - 1))
+		if(strcmp(aliasTable[bucket].name, key) == 0) return &aliasTable[bucket];
+	return NULL;
+}
+
+int setAlias(const char *name, const char *value){
+	struct alias_t *alias = findAlias(name, strlen(name));
+	if(alias != NULL){
+		free(alias->value);
+		alias->value = strdup(value);
+		return 0;
+	}
+	if(aliasCount >= aliasBuckets / 2) return -1;
+	unsigned int bucket = hashBuiltinName(name) & (aliasBuckets - 1);
+	while(aliasTable[bucket].name != NULL) bucket = (bucket + 1) & (aliasBuckets - 1);
+	aliasTable[bucket].name = strdup(name);
+	aliasTable[bucket].value = strdup(value);
+	aliasCount++;
+	return 0;
+}
+
+/*
+   Removes an alias, the rest of its cluster is inserted again like in unregisterBuiltin.
+   */
+int removeAlias(const char *name){
+	struct alias_t *alias = findAlias(name, strlen(name));
+	if(alias == NULL) return -1;
+	free(alias->name);
+	free(alias->value);
+	alias->name = NULL;
+	aliasCount--;
+	for(unsigned int bucket = (alias - aliasTable + 1) & (aliasBuckets - 1); aliasTable[bucket].name != NULL; bucket = (bucket + 1) & (aliasBuckets - 1)){
+		struct alias_t moved = aliasTable[bucket];
+		aliasTable[bucket].name = NULL;
+		aliasCount--;
+		setAlias(moved.name, moved.value);
+		free(moved.name);
+		free(moved.value);
+	}
+	return 0;
+}
+
+/*
+   Replaces the first word of every command of a line when it is an alias. Returns the new line,
+   or NULL when nothing was replaced. Substitutions are left to the shell that runs them.
+   */
+char *applyAliases(const char *line){
+	struct expansion_t out = {NULL, 0, 0};
+	bool commandPosition = true, replaced = false;
+	char quote = 0;
+	if(aliasCount == 0) return NULL;
+
+	for(const char *p = line; *p; ){
+		if(commandPosition && !quote){
+			size_t space = strspn(p, " \t");
+			appendExpansion(&out, p, space);
+			p += space;
+			size_t len = strcspn(p, " \t|'\"\\$");
+			struct alias_t *alias = len > 0 && strchr(" \t|", p[len]) != NULL ? findAlias(p, len) : NULL;
+			if(alias != NULL){
+				appendExpansion(&out, alias->value, strlen(alias->value));
+				p += len;
+				replaced = true;
+			}
+			commandPosition = false;
+			continue;
+		}
+		if(quote != '\'' && *p == '$' && p[1] == '('){
+			const char *end = findSubstitutionEnd(p + 2);
+			size_t len = end != NULL ? (size_t)(end - p + 1) : strlen(p);
+			appendExpansion(&out, p, len);
+			p += len;
+			continue;
+		}
+		if(quote){
+			if(*p == quote) quote = 0;
+		}else if(*p == '\'' || *p == '"') quote = *p;
+		else if(*p == '\\' && p[1] != 0){
+			appendExpansion(&out, p, 2);
+			p += 2;
+			continue;
+		}else if(*p == '|') commandPosition = true;
+		appendExpansion(&out, p, 1);
+		p++;
+	}
+	if(!replaced){
+		free(out.data);
+		return NULL;
+	}
+	return out.data;
+}
+
+/*
+   alias [name=value]... defines aliases, alias alone lists them.
+   */
+int builtinAlias(struct command_t *command){
+	if(command->arg_count == 0){
+		for(int i = 0; i < aliasBuckets; i++)
+			if(aliasTable[i].name != NULL) printf("alias %s='%s'\n", aliasTable[i].name, aliasTable[i].value);
 		return SUCCESS;
 	}
+	for(int i = 0; i < command->arg_count; i++){
+		char *word = command->args[i], *equals = strchr(word, '=');
+		struct alias_t *alias = findAlias(word, equals ? (size_t)(equals - word) : strlen(word));
+		if(equals == NULL){
+			if(alias != NULL) printf("alias %s='%s'\n", alias->name, alias->value);
+			else{
+				printf("-%s: %s: %s: not found\n", sysname, command->name, word);
+				lastStatus = 1;
+			}
+			continue;
+		}
+		*equals = 0;
+		if(!isVariableName(word, strlen(word)) || setAlias(word, equals + 1) != 0){
+			printf("-%s: %s: %s: cannot be an alias\n", sysname, command->name, word);
+			lastStatus = 1;
+		}
+		*equals = '=';
+	}
+	return SUCCESS;
+}
+
+int builtinUnalias(struct command_t *command){
+	for(int i = 0; i < command->arg_count; i++){
+		if(removeAlias(command->args[i]) == 0) continue;
+		printf("-%s: %s: %s: not found\n", sysname, command->name, command->args[i]);
+		lastStatus = 1;
+	}
+	return SUCCESS;
+}
+
+/*
+   The PROMPT variable is a template compiled into segments once per value:
+   %u user, %h host, %w working directory, %W its last directory, %~ the working directory
+   with the home as ~, %s shell name, %? last status, %j background jobs and %% a percent sign.
+   */
+struct prompt_segment_t
+{
+	char type;					// 't' for text, otherwise the letter after %
+	char *text;
+};
+
+static struct prompt_segment_t promptSegments[maxPromptSegments];
+static int promptSegmentCount = 0;
+static char *compiledPromptFor = NULL;
+static char promptHost[256];
+
+void addPromptSegment(char type, const char *text, size_t len){
+	if(promptSegmentCount == maxPromptSegments) return;
+	promptSegments[promptSegmentCount].type = type;
+	promptSegments[promptSegmentCount].text = type == 't' ? strndup(text, len) : NULL;
+	promptSegmentCount++;
+}
+
+void clearPromptSegments(){
+	for(int i = 0; i < promptSegmentCount; i++) free(promptSegments[i].text);
+	promptSegmentCount = 0;
+	free(compiledPromptFor);
+	compiledPromptFor = NULL;
+}
+
+void compilePrompt(const char *template){
+	clearPromptSegments();
+	compiledPromptFor = strdup(template);
+	const char *text = template;
+	for(const char *p = template; *p; p++){
+		if(*p != '%' || p[1] == 0 || strchr("uhwW~s?j%", p[1]) == NULL) continue;
+		if(p > text) addPromptSegment('t', text, p - text);
+		if(p[1] == '%') addPromptSegment('t', "%", 1);
+		else addPromptSegment(p[1], "", 0);
+		text = p + 2;
+		p++;
+	}
+	if(*text) addPromptSegment('t', text, strlen(text));
+}
+
+/*
+   Prints the prompt from the PROMPT template, returns false when PROMPT is not set.
+   */
+bool showPromptTemplate(){
+	const char *template = getVariable("PROMPT");
+	if(template == NULL) return false;
+	if(compiledPromptFor == NULL || strcmp(compiledPromptFor, template) != 0) compilePrompt(template);
+	if(promptHost[0] == 0) gethostname(promptHost, sizeof(promptHost) - 1);
+
+	char *cwd = NULL;
+	for(int i = 0; i < promptSegmentCount; i++){
+		struct prompt_segment_t *segment = &promptSegments[i];
+		if(strchr("wW~", segment->type) != NULL && cwd == NULL) cwd = getcwd(NULL, 0);
+		const char *home = getVariable("HOME");
+		size_t homeLen = home ? strlen(home) : 0;
+		int jobCount = 0;
+		switch(segment->type){
+			case 't': fputs(segment->text, stdout); break;
+			case 'u': fputs(getenv("USER") ? getenv("USER") : "", stdout); break;
+			case 'h': fputs(promptHost, stdout); break;
+			case 's': fputs(sysname, stdout); break;
+			case '?': printf("%d", lastStatus); break;
+			case 'w': fputs(cwd ? cwd : "?", stdout); break;
+			case 'W': fputs(cwd ? (strrchr(cwd, '/')[1] ? strrchr(cwd, '/') + 1 : cwd) : "?", stdout); break;
+			case '~':
+				if(cwd && homeLen > 1 && strncmp(cwd, home, homeLen) == 0 && (cwd[homeLen] == '/' || cwd[homeLen] == 0))
+					printf("~%s", cwd + homeLen);
+				else fputs(cwd ? cwd : "?", stdout);
+				break;
+			case 'j':
+				for(int j = 0; j < maxJobs; j++) jobCount += jobs[j].id != 0 && !jobs[j].quiet;
+				printf("%d", jobCount);
+				break;
+		}
+	}
+	free(cwd);
+	return true;
+}
+
+/*
+   Startup configuration: ~/.shellfyrerc (or SHELLFYRE_RC) is run line by line through the same
+   expansion and parser as typed input. What it leaves behind is kept in a startup cache, keyed
+   by the path, mtime and size of the rc file and the mtimes of the PATH directories: the compiled
+   prompt, the rc lines in their order and the command paths. A line that needs no expansion is
+   kept split into words, after the aliases defined before it were applied. While nothing in the
+   key changed, a start loads the cache and runs those lines without parsing the file.
+   */
+void profilePhase(const char *phase){
+	unsigned long long now = traceNow();
+	if(startupProfile) fprintf(stderr, "startup.%s %.3f ms\n", phase, (now - profileStart) / 1e6);
+	profileStart = now;
+}
+
+int startupCachePath(const char *rcPath, char *path, size_t size){
+	char directory[PATH_MAX];
+	if(shellfyreCacheDir("SHELLFYRE_STARTUP_CACHE", "startup", directory, sizeof(directory)) != 0) return -1;
+	int len = snprintf(path, size, "%s/%08x", directory, hashBuiltinName(rcPath));
+	return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+// a line that expands to itself can be kept as words, anything else is parsed on every start
+bool needsExpansion(const char *line){
+	return strpbrk(line, "$~{*?[|<>&\\") != NULL;
+}
+
+/*
+   Makes the cache record of an rc line, before the line runs, so only the aliases defined
+   above it are applied. A line needing expansion is kept as it is, its aliases are applied
+   again when it is replayed after the same alias lines.
+   */
+char *startupRecord(const char *text){
+	char *aliased = applyAliases(text), *record = NULL;
+	const char *effective = aliased ? aliased : text;
+	size_t size = 0;
+	FILE *fp = open_memstream(&record, &size);
+
+	if(needsExpansion(effective)){
+		fprintf(fp, "line %s\n", text);
+	}else{
+		struct command_t *command = calloc(1, sizeof(struct command_t));
+		char *copy = strdup(effective);
+		parse_command(copy, command);
+		fprintf(fp, "words %d\n%s\n", command->arg_count + 1, command->name);
+		for(int j = 0; j < command->arg_count; j++) fprintf(fp, "%s\n", command->args[j]);
+		free(copy);
+		free_command(command);
+	}
+	fclose(fp);
+	free(aliased);
+	return record;
+}
+
+// mtime of a PATH directory as stored in the cache, -1 when it does not exist
+void pathDirectoryStamp(const char *directory, char *stamp, size_t size){
+	struct stat st;
+	if(stat(directory, &st) != 0) snprintf(stamp, size, "-1 0");
+	else snprintf(stamp, size, "%lld %ld", (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+/*
+   Writes the cache next to the rc run that just finished, into a temporary file renamed over the old one.
+   */
+void writeStartupCache(const char *cachePath, const char *rcPath, const struct stat *rc, char **records, int recordCount){
+	char temporaryPath[PATH_MAX + 32], directory[PATH_MAX], stamp[64];
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp", cachePath, (int)getpid());
+	FILE *fp = fopen(temporaryPath, "w");
+	if(fp == NULL) return;
+
+	fprintf(fp, "%s\nrc %s\nstamp %lld %ld %lld\n", startupCacheVersion, rcPath,
+			(long long)rc->st_mtim.tv_sec, rc->st_mtim.tv_nsec, (long long)rc->st_size);
+	//a command installed in a PATH directory changes its mtime and so the key
+	int directoryCount = 0;
+	const char *path = commandPathsFor ? commandPathsFor : "";
+	for(const char *entry = path; *entry; directoryCount++){
+		entry += strcspn(entry, ":");
+		if(*entry == ':') entry++;
+	}
+	fprintf(fp, "pathdirs %d\n", directoryCount);
+	for(const char *entry = path; *entry; ){
+		size_t len = strcspn(entry, ":");
+		snprintf(directory, sizeof(directory), "%.*s", (int)len, len > 0 ? entry : ".");
+		pathDirectoryStamp(directory, stamp, sizeof(stamp));
+		fprintf(fp, "%s %s\n", stamp, directory);
+		entry += len;
+		if(*entry == ':') entry++;
+	}
+
+	if(compiledPromptFor != NULL){
+		fprintf(fp, "prompt %s\n", compiledPromptFor);
+		for(int i = 0; i < promptSegmentCount; i++)
+			fprintf(fp, "segment %c%s\n", promptSegments[i].type, promptSegments[i].type == 't' ? promptSegments[i].text : "");
+	}
+	for(int i = 0; i < recordCount; i++) fputs(records[i], fp);
+	//the command table comes last, it is only loaded once the lines have set PATH
+	if(commandPathsFor != NULL){
+		fprintf(fp, "path %s\n", commandPathsFor);
+		for(int i = 0; i < commandPathBuckets; i++)
+			if(commandPaths[i].name != NULL) fprintf(fp, "command %s\t%s\n", commandPaths[i].name, commandPaths[i].path);
+	}
+	if(fclose(fp) != 0 || rename(temporaryPath, cachePath) != 0) unlink(temporaryPath);
+}
+
+char *readCacheLine(FILE *fp, char **buffer, size_t *size){
+	ssize_t len = getline(buffer, size, fp);
+	if(len <= 0) return NULL;
+	if((*buffer)[len - 1] == '\n') (*buffer)[len - 1] = 0;
+	return *buffer;
+}
+
+/*
+   Loads the startup cache and runs its lines. Returns -1 without running anything when the
+   cache is missing, was made for another version of the rc file or a PATH directory changed.
+   */
+int loadStartupCache(const char *cachePath, const char *rcPath, const struct stat *rc){
+	char *line = NULL, stamp[128];
+	size_t size = 0;
+	FILE *fp = fopen(cachePath, "r");
+	if(fp == NULL) return -1;
+
+	snprintf(stamp, sizeof(stamp), "stamp %lld %ld %lld",
+			(long long)rc->st_mtim.tv_sec, rc->st_mtim.tv_nsec, (long long)rc->st_size);
+	bool valid = readCacheLine(fp, &line, &size) && strcmp(line, startupCacheVersion) == 0 &&
+		readCacheLine(fp, &line, &size) && strncmp(line, "rc ", 3) == 0 && strcmp(line + 3, rcPath) == 0 &&
+		readCacheLine(fp, &line, &size) && strcmp(line, stamp) == 0 &&
+		readCacheLine(fp, &line, &size) && strncmp(line, "pathdirs ", 9) == 0;
+	for(int i = 0, count = valid ? atoi(line + 9) : 0; valid && i < count; i++){
+		int directory = 0;
+		valid = readCacheLine(fp, &line, &size) && sscanf(line, "%*d %*d %n", &directory) == 0 && directory > 0;
+		if(!valid) break;
+		pathDirectoryStamp(line + directory, stamp, sizeof(stamp));
+		valid = strlen(stamp) == (size_t)directory - 1 && strncmp(line, stamp, directory - 1) == 0;
+	}
+	if(!valid){
+		free(line);
+		fclose(fp);
+		return -1;
+	}
+
+	bool samePath = false;
+	while(readCacheLine(fp, &line, &size)){
+		char *tab = strchr(line, '\t');
+		if(strncmp(line, "prompt ", 7) == 0){
+			clearPromptSegments();
+			compiledPromptFor = strdup(line + 7);
+		}else if(strncmp(line, "segment ", 8) == 0 && line[8] != 0){
+			addPromptSegment(line[8], line + 9, strlen(line + 9));
+		}else if(strncmp(line, "path ", 5) == 0){
+			//the lines ran already, the table is only valid for the PATH they left behind
+			samePath = strcmp(checkCommandPaths(), line + 5) == 0;
+		}else if(strncmp(line, "command ", 8) == 0 && tab != NULL){
+			*tab = 0;
+			if(samePath) addCommandPath(line + 8, tab + 1);
+		}else if(strncmp(line, "line ", 5) == 0){
+			struct command_t *command = calloc(1, sizeof(struct command_t));
+			expandAndParse(line + 5, command);
+			process_command(command);
+			free_command(command);
+		}else if(strncmp(line, "words ", 6) == 0){
+			//split into words and aliased when the cache was made, nothing to parse
+			int count = atoi(line + 6);
+			struct command_t *command = calloc(1, sizeof(struct command_t));
+			command->args = malloc(sizeof(char *) * (count > 0 ? count : 1));
+			for(int i = 0; i < count && readCacheLine(fp, &line, &size); i++){
+				if(i == 0) command->name = strdup(line);
+				else command->args[command->arg_count++] = strdup(line);
+			}
+			if(command->name == NULL) command->name = strdup("");
+			process_command(command);
+			free_command(command);
+		}
+	}
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
+/*
+   Runs the rc file, from the startup cache when it is still valid.
+   */
+void loadStartupConfig(){
+	char rcPath[PATH_MAX], cachePath[PATH_MAX];
+	const char *configured = getenv("SHELLFYRE_RC"), *home = getenv("HOME");
+	struct stat rc;
+	if(configured != NULL) snprintf(rcPath, sizeof(rcPath), "%s", configured);
+	else if(home != NULL) snprintf(rcPath, sizeof(rcPath), "%s/%s", home, rcFileName);
+	else return;
+	if(stat(rcPath, &rc) != 0) return;
+
+	bool cached = startupCachePath(rcPath, cachePath, sizeof(cachePath)) == 0;
+	if(cached && loadStartupCache(cachePath, rcPath, &rc) == 0){
+		profilePhase("rc_cache");
+		return;
+	}
+
+	FILE *fp = fopen(rcPath, "r");
+	if(fp == NULL) return;
+	char *line = NULL, **records = NULL;
+	size_t size = 0;
+	int recordCount = 0;
+	while(readCacheLine(fp, &line, &size)){
+		char *text = line + strspn(line, " \t");
+		if(text[0] == 0 || text[0] == '#') continue;
+		//every line is replayed in order, alias definitions included
+		records = realloc(records, sizeof(char *) * (recordCount + 1));
+		records[recordCount++] = startupRecord(text);
+		struct command_t *command = calloc(1, sizeof(struct command_t));
+		expandAndParse(text, command);
+		process_command(command);
+		free_command(command);
+	}
+	free(line);
+	fclose(fp);
+	profilePhase("rc_parse");
+
+	const char *template = getVariable("PROMPT");
+	if(template != NULL) compilePrompt(template);
+	warmCommandPaths();
+	profilePhase("command_paths");
+	if(cached) writeStartupCache(cachePath, rcPath, &rc, records, recordCount);
+	for(int i = 0; i < recordCount; i++) free(records[i]);
+	free(records);
+	profilePhase("cache_write");
+}
+
+/*
+   Server mode: shellfyre --server [socket] keeps one warm shell, with its builtin registry,
+   command paths, pokedex and history file in place, and runs the command lines of
+   shellfyre --client. The client passes its stdin, stdout, stderr and working directory
+   over the socket with SCM_RIGHTS. Every request runs in its own forked child, so many
+   clients are served at once, and gets the exit status of its command back.
+   Both sides check with SO_PEERCRED that the other end runs as the same user.
+   */
+int serverSocketPath(const char *configured, char *path, size_t size){
+	const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+	int len;
+	if(configured != NULL) len = snprintf(path, size, "%s", configured);
+	else if(runtimeDir != NULL && runtimeDir[0] == '/') len = snprintf(path, size, "%s/shellfyre.sock", runtimeDir);
+	else{
+		//never a guessable name in /tmp, without a runtime directory the socket lives in the cache
+		char directory[PATH_MAX];
+		if(shellfyreCacheDir("SHELLFYRE_SERVER_DIR", "server", directory, sizeof(directory)) != 0) return -1;
+		len = snprintf(path, size, "%s/shellfyre.sock", directory);
+	}
+	return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+/*
+   The directory holding the socket must belong to this user and be writable by no one
+   else, otherwise another user could put a socket of their own in its place.
+   */
+int checkSocketDirectory(const char *path){
+	char directory[PATH_MAX];
+	struct stat st;
+	const char *slash = strrchr(path, '/');
+	if(slash == NULL) snprintf(directory, sizeof(directory), ".");
+	else snprintf(directory, sizeof(directory), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+
+	if(lstat(directory, &st) != 0) return -1;
+	if(!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 022) != 0){
+		errno = EPERM;
+		return -1;
+	}
+	return 0;
+}
+
+// the other end of a unix socket has to run as the same user
+bool samePeerUser(int sock){
+	struct ucred credentials;
+	socklen_t len = sizeof(credentials);
+	return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials, &len) == 0 && credentials.uid == getuid();
+}
+
+int connectServer(const char *path){
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(sock >= 0 && connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0){
+		close(sock);
+		return -1;
+	}
+	if(sock >= 0 && !samePeerUser(sock)){
+		close(sock);
+		errno = EPERM;
+		return -1;
+	}
+	return sock;
+}
+
+/*
+   Turns the words of a request into a command line. A single word is a command line
+   of its own, like sh -c; several words are run as they are, each one single quoted
+   so that no space, quote or wildcard in them is read by the parser.
+   */
+int requestLine(char **words, unsigned int wordCount, char *line, size_t size){
+	size_t used = 0;
+	if(wordCount == 1) return snprintf(line, size, "%s", words[0]) < (int)size ? 0 : -1;
+	for(unsigned int i = 0; i < wordCount; i++){
+		if(used + 4 > size) return -1;
+		if(i > 0) line[used++] = ' ';
+		line[used++] = '\'';
+		for(const char *p = words[i]; *p; p++){
+			if(used + 6 > size) return -1;
+			if(*p == '\'') used += sprintf(line + used, "'\\''");
+			else line[used++] = *p;
+		}
+		line[used++] = '\'';
+	}
+	line[used] = 0;
+	return 0;
+}
+
+/*
+   Runs one request in a child of the server, never returns.
+   */
+void serveRequest(int client){
+	char *request = malloc(maxServerLine), *line = malloc(maxServerLine);
+	char **words = malloc(sizeof(char *) * (maxServerLine / 2));
+	unsigned int wordCount = 0;
+	char control[CMSG_SPACE(sizeof(int) * serverRequestFds)];
+	struct iovec iov = {request, maxServerLine};
+	struct msghdr message;
+	int fds[serverRequestFds], fdCount = 0, status = 2;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	ssize_t len = recvmsg(client, &message, MSG_CMSG_CLOEXEC);
+	for(struct cmsghdr *header = CMSG_FIRSTHDR(&message); len > 0 && header != NULL; header = CMSG_NXTHDR(&message, header)){
+		if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+		fdCount = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if(fdCount > serverRequestFds) fdCount = serverRequestFds;
+		memcpy(fds, CMSG_DATA(header), sizeof(int) * fdCount);
+	}
+
+	//a request is a word count and that many NUL terminated words
+	bool valid = len > (ssize_t)sizeof(wordCount) && fdCount == serverRequestFds && !(message.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+	if(valid){
+		unsigned int expected;
+		memcpy(&expected, request, sizeof(expected));
+		for(ssize_t offset = sizeof(expected); offset < len && wordCount < expected && wordCount < maxServerLine / 2; ){
+			char *end = memchr(request + offset, 0, len - offset);
+			if(end == NULL) break;
+			words[wordCount++] = request + offset;
+			offset = end - request + 1;
+		}
+		valid = wordCount > 0 && wordCount == expected && requestLine(words, wordCount, line, maxServerLine) == 0;
+	}
+	if(valid){
+		//the request runs with the terminal and directory of the client
+		for(int i = 0; i < 3; i++){
+			dup2(fds[i], i);
+			close(fds[i]);
+		}
+		if(fchdir(fds[3]) == 0){
+			struct command_t *command = calloc(1, sizeof(struct command_t));
+			lastStatus = 0;
+			expandAndParse(line, command);
+			process_command(command);
+			status = lastStatus;
+		}
+		close(fds[3]);
+	}
+	fflush(stdout);
+	fflush(stderr);
+	send(client, &status, sizeof(status), MSG_NOSIGNAL);
+	exit(0);
+}
+
+int runServer(const char *configured){
+	char path[PATH_MAX];
+	struct sockaddr_un address;
+	if(serverSocketPath(configured, path, sizeof(path)) != 0 || strlen(path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "-%s: server: socket path is too long\n", sysname);
+		return 1;
+	}
+	if(checkSocketDirectory(path) != 0){
+		fprintf(stderr, "-%s: server: %s: directory must be yours and not writable by others\n", sysname, path);
+		return 1;
+	}
+
+	//a socket nobody answers on is left over from a server that died
+	int running = connectServer(path);
+	if(running >= 0){
+		fprintf(stderr, "-%s: server: already running on %s\n", sysname, path);
+		close(running);
+		return 1;
+	}
+	unlink(path);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	mode_t mask = umask(077);
+	int bound = sock >= 0 ? bind(sock, (struct sockaddr *)&address, sizeof(address)) : -1;
+	umask(mask);
+	if(bound != 0 || listen(sock, serverBacklog) != 0){
+		fprintf(stderr, "-%s: server: %s: %s\n", sysname, path, strerror(errno));
+		return 1;
+	}
+
+	//warming everything the requests would otherwise load on their own
+	warmCommandPaths();
+	FILE *pokedexFile = openPokedexFile();
+	if(pokedexFile != NULL){
+		fclose(pokedexFile);
+		loadPokedex();
+	}
+	if(recDirOpened == 0) initializeFilePath();
+	//finished requests are reaped by the kernel
+	signal(SIGCHLD, SIG_IGN);
+	printf("%s server listening on %s\n", sysname, path);
+	fflush(stdout);
+
+	while(1){
+		int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if(client < 0){
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "-%s: server: %s\n", sysname, strerror(errno));
+			break;
+		}
+		if(!samePeerUser(client)){
+			close(client);
+			continue;
+		}
+		pid_t pid = fork();
+		if(pid == 0){
+			signal(SIGCHLD, SIG_DFL);
+			close(sock);
+			serveRequest(client);
+		}
+		if(pid < 0) fprintf(stderr, "-%s: server: fork: %s\n", sysname, strerror(errno));
+		close(client);
+	}
+	close(sock);
+	unlink(path);
+	return 1;
+}
+
+/*
+   shellfyre --client [-s socket] <command line | words...> runs a command in the server with
+   the fds and directory of the client, and exits with its status. The words are sent as a
+   count and a vector, so the server sees them exactly as the client got them.
+   */
+int runClient(const char *configured, char **words, int wordCount){
+	char path[PATH_MAX], *request = malloc(maxServerLine);
+	unsigned int count = wordCount;
+	size_t used = sizeof(count);
+	memcpy(request, &count, sizeof(count));
+	for(int i = 0; i < wordCount; i++){
+		size_t wordLen = strlen(words[i]) + 1;
+		if(used + wordLen > maxServerLine){
+			fprintf(stderr, "-%s: client: command line is too long\n", sysname);
+			return 2;
+		}
+		memcpy(request + used, words[i], wordLen);
+		used += wordLen;
+	}
+
+	int sock = -1;
+	if(serverSocketPath(configured, path, sizeof(path)) == 0 && checkSocketDirectory(path) == 0) sock = connectServer(path);
+	if(sock < 0){
+		fprintf(stderr, "-%s: client: %s: %s\n", sysname, path, strerror(errno));
+		return 127;
+	}
+
+	int fds[serverRequestFds] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)};
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = {request, used};
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	memset(control, 0, sizeof(control));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(header), fds, sizeof(fds));
 
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+	int status = 255;
+	if(fds[3] < 0 || sendmsg(sock, &message, 0) < 0)
+		fprintf(stderr, "-%s: client: %s\n", sysname, strerror(errno));
+	else if(recv(sock, &status, sizeof(status), 0) != sizeof(status))
+		status = 255;	// the request died without an answer
+	close(sock);
+	return status;
 }
@@ -0,0 +1,33 @@
+#ifndef SHELLFYRE_PLUGIN_H
+#define SHELLFYRE_PLUGIN_H
+
+/** Plugin interface of shellfyre
+  A plugin is a shared object loaded with the load builtin. It exports
+  shellfyre_plugin_abi, which must equal SHELLFYRE_PLUGIN_ABI, and
+  shellfyre_plugin_init, which registers its builtins through the host.
+  shellfyre_plugin_fini is optional and called by unload.
+ **/
+
+#define SHELLFYRE_PLUGIN_ABI 1
+
+struct shellfyre_builtin
+{
+	const char *name;
+	int min_args;
+	int max_args;						// -1 for no limit
+	int (*run)(int argc, char **argv);	// argv[0] is the name, argv[argc] is NULL, returns an exit status
+	const char *help;
+};
+
+struct shellfyre_host
+{
+	int abi_version;
+	// the descriptor is not copied, it must stay valid until the plugin is unloaded
+	int (*register_builtin)(struct shellfyre_host *host, const struct shellfyre_builtin *builtin);
+	void *context;						// owned by the shell, do not touch
+};
+
+typedef int (*shellfyre_plugin_init_t)(struct shellfyre_host *host);	// returns 0 on success
+typedef void (*shellfyre_plugin_fini_t)(void);
+
+#endif